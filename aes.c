@@ -37,6 +37,17 @@ NOTE:   String length must be evenly divisible by 16byte (str_len % 16 == 0)
 #include <string.h> // CBC mode, for memset
 #include "aes.h"
 
+#if AES128_STAGE_TIMING || AES128_STATS
+  #include <stdio.h>
+#endif
+#if AES128_STAGE_TIMING
+  #if defined(__x86_64__) || defined(__i386__)
+    #include <x86intrin.h>
+  #else
+    #include <time.h>
+  #endif
+#endif
+
 
 /*****************************************************************************/
 /* Defines:                                                                  */
@@ -57,6 +68,54 @@ NOTE:   String length must be evenly divisible by 16byte (str_len % 16 == 0)
   #define MULTIPLY_AS_A_FUNCTION 0
 #endif
 
+// Define COMPUTE_TABLES to 1 to build without the S-box, inverse S-box and Rcon tables
+// in ROM. They are computed into RAM (523 bytes) by the first call into the library
+// instead.
+#ifndef COMPUTE_TABLES
+  #define COMPUTE_TABLES 0
+#endif
+
+// Define KEY_SCHEDULE_ON_THE_FLY to 1 to have AES128_ECB_encrypt() derive each round key
+// right before it is used, from 16 bytes of key state, instead of expanding all 176
+// bytes first. AES128_ECB_decrypt() then runs the schedule backwards from the last round
+// key in the same way. Saves RAM and time when every key is used only for a block or two.
+#ifndef KEY_SCHEDULE_ON_THE_FLY
+  #define KEY_SCHEDULE_ON_THE_FLY 0
+#endif
+
+// STAT_ADD(stat, n) adds n to a counter of the AES128_STATS build, and to the calling
+// thread's flow counters if it set them with AES128_stats_flow(). Nothing otherwise.
+#if AES128_STATS
+  #ifndef AES128_STATS_SHARDS
+    #define AES128_STATS_SHARDS 16
+  #endif
+  #define STAT_ADD(stat, n) StatAdd(stat, n)
+#else
+  #define STAT_ADD(stat, n)
+#endif
+
+// TIMED(stage, call) adds the time taken by call to the stage's total in the
+// AES128_STAGE_TIMING build and is just call otherwise.
+#if AES128_STAGE_TIMING
+  #if defined(__x86_64__) || defined(__i386__)
+    #define STAGE_CLOCK() __rdtsc()
+    #define STAGE_UNIT    "cycles"
+  #else
+    #define STAGE_CLOCK() StageNanoseconds()
+    #define STAGE_UNIT    "ns"
+  #endif
+  #define TIMED(stage, call)                              \
+    do                                                    \
+    {                                                     \
+      uint64_t t0_ = STAGE_CLOCK();                       \
+      call;                                               \
+      StageTotal[stage] += STAGE_CLOCK() - t0_;           \
+      ++StageCalls[stage];                                \
+    } while(0)
+#else
+  #define TIMED(stage, call) call
+#endif
+
 
 /*****************************************************************************/
 /* Private variables:                                                        */
@@ -65,21 +124,95 @@ NOTE:   String length must be evenly divisible by 16byte (str_len % 16 == 0)
 typedef uint8_t state_t[4][4];
 static state_t* _state;
 
-// The array that stores the round keys.
-static uint8_t RoundKey[176];
-
-// The Key input to the AES Program
-static const uint8_t* Key;
+#if (defined(CBC) && CBC) || !KEY_SCHEDULE_ON_THE_FLY
+  // The round keys used by the ECB and CBC functions, kept between CBC calls.
+  static AES128_key_t CurrentKey;
+#endif
 
 #if defined(CBC) && CBC
   // Initial Vector used only for CBC mode
   static uint8_t* Iv;
 #endif
 
+#if AES128_STATS
+// One shard of the counters per cache line. Threads pick a shard round robin on first use,
+// with more threads than shards some share one, which the atomic adds keep correct.
+typedef struct
+{
+  uint64_t counter[AES128_STATS_COUNT];
+} AES128_ALIGNED stat_shard_t;
+
+static stat_shard_t StatShard[AES128_STATS_SHARDS];
+static unsigned StatNextShard;
+static __thread unsigned StatShardIndex;   // shard + 1, 0 until the thread's first count
+static __thread AES128_stats_t* StatFlow;  // set by AES128_stats_flow(), 0 for none
+
+// Names, labels and help texts of the counters for AES128_stats_prometheus(). Counters of
+// the same metric are next to each other.
+static const struct
+{
+  const char* name;
+  const char* labels;
+  const char* help;
+} StatMetric[AES128_STATS_COUNT] =
+{
+  { "aes128_blocks_total", "mode=\"ecb\",op=\"encrypt\"", "Blocks processed." },
+  { "aes128_blocks_total", "mode=\"ecb\",op=\"decrypt\"", 0 },
+  { "aes128_blocks_total", "mode=\"cbc\",op=\"encrypt\"", 0 },
+  { "aes128_blocks_total", "mode=\"cbc\",op=\"decrypt\"", 0 },
+  { "aes128_bytes_total", "mode=\"ecb\",op=\"encrypt\"", "Message bytes processed, before padding." },
+  { "aes128_bytes_total", "mode=\"ecb\",op=\"decrypt\"", 0 },
+  { "aes128_bytes_total", "mode=\"cbc\",op=\"encrypt\"", 0 },
+  { "aes128_bytes_total", "mode=\"cbc\",op=\"decrypt\"", 0 },
+  { "aes128_key_expansions_total", "schedule=\"full\"", "Key schedules computed." },
+  { "aes128_key_expansions_total", "schedule=\"last_round_key\"", 0 },
+  { "aes128_key_reuses_total", "", "Messages processed with a key schedule expanded earlier." },
+  { "aes128_cipher_blocks_total", "schedule=\"stored\"", "Blocks by cipher implementation." },
+  { "aes128_cipher_blocks_total", "schedule=\"on_the_fly\"", 0 },
+};
+#endif
+
+#if AES128_STAGE_TIMING
+// The stages reported by AES128_stage_report(). STAGE_MASK is the masking of Cipher():
+// adding and removing the mask and carrying it through ShiftRows and MixColumns.
+enum
+{
+  STAGE_KEY_EXPANSION,
+  STAGE_MASK,
+  STAGE_SUB_BYTES,
+  STAGE_SHIFT_ROWS,
+  STAGE_MIX_COLUMNS,
+  STAGE_ADD_ROUND_KEY,
+  STAGE_INV_SUB_BYTES,
+  STAGE_INV_SHIFT_ROWS,
+  STAGE_INV_MIX_COLUMNS,
+  STAGES
+};
+
+static const char* const StageName[STAGES] =
+{
+  "KeyExpansion", "mask", "SubBytesm", "ShiftRows", "MixColumns", "AddRoundKey",
+  "InvSubBytes", "InvShiftRows", "InvMixColumns"
+};
+
+static uint64_t StageTotal[STAGES];
+static uint64_t StageCalls[STAGES];
+#endif
+
 // The lookup-tables are marked const so they can be placed in read-only storage instead of RAM
 // The numbers below can be computed dynamically trading ROM for RAM - 
 // This can be useful in (embedded) bootloader applications, where ROM is often limited.
-static const uint8_t sbox[256] =   {
+#if COMPUTE_TABLES
+
+// The same tables as the constant ones below, filled by InitTables().
+static uint8_t sbox[256] AES128_ALIGNED;
+static uint8_t rsbox[256] AES128_ALIGNED;
+static uint8_t Rcon[11];
+static uint8_t tables_state;   // 0 not computed, 1 being computed, 2 ready
+
+#else
+
+static const uint8_t sbox[256] AES128_ALIGNED = {
   //0     1    2      3     4    5     6     7      8    9     A      B    C     D     E     F
   0x63, 0x7c, 0x77, 0x7b, 0xf2, 0x6b, 0x6f, 0xc5, 0x30, 0x01, 0x67, 0x2b, 0xfe, 0xd7, 0xab, 0x76,
   0xca, 0x82, 0xc9, 0x7d, 0xfa, 0x59, 0x47, 0xf0, 0xad, 0xd4, 0xa2, 0xaf, 0x9c, 0xa4, 0x72, 0xc0,
@@ -98,7 +231,7 @@ static const uint8_t sbox[256] =   {
   0xe1, 0xf8, 0x98, 0x11, 0x69, 0xd9, 0x8e, 0x94, 0x9b, 0x1e, 0x87, 0xe9, 0xce, 0x55, 0x28, 0xdf,
   0x8c, 0xa1, 0x89, 0x0d, 0xbf, 0xe6, 0x42, 0x68, 0x41, 0x99, 0x2d, 0x0f, 0xb0, 0x54, 0xbb, 0x16 };
 
-static const uint8_t rsbox[256] =
+static const uint8_t rsbox[256] AES128_ALIGNED =
 { 0x52, 0x09, 0x6a, 0xd5, 0x30, 0x36, 0xa5, 0x38, 0xbf, 0x40, 0xa3, 0x9e, 0x81, 0xf3, 0xd7, 0xfb,
   0x7c, 0xe3, 0x39, 0x82, 0x9b, 0x2f, 0xff, 0x87, 0x34, 0x8e, 0x43, 0x44, 0xc4, 0xde, 0xe9, 0xcb,
   0x54, 0x7b, 0x94, 0x32, 0xa6, 0xc2, 0x23, 0x3d, 0xee, 0x4c, 0x95, 0x0b, 0x42, 0xfa, 0xc3, 0x4e,
@@ -118,30 +251,124 @@ static const uint8_t rsbox[256] =
 
 
 // The round constant word array, Rcon[i], contains the values given by 
-// x to th e power (i-1) being powers of x (x is denoted as {02}) in the field GF(2^8)
-// Note that i starts at 1, not 0).
-static const uint8_t Rcon[255] = {
-  0x8d, 0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, 0x80, 0x1b, 0x36, 0x6c, 0xd8, 0xab, 0x4d, 0x9a, 
-  0x2f, 0x5e, 0xbc, 0x63, 0xc6, 0x97, 0x35, 0x6a, 0xd4, 0xb3, 0x7d, 0xfa, 0xef, 0xc5, 0x91, 0x39, 
-  0x72, 0xe4, 0xd3, 0xbd, 0x61, 0xc2, 0x9f, 0x25, 0x4a, 0x94, 0x33, 0x66, 0xcc, 0x83, 0x1d, 0x3a, 
-  0x74, 0xe8, 0xcb, 0x8d, 0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, 0x80, 0x1b, 0x36, 0x6c, 0xd8, 
-  0xab, 0x4d, 0x9a, 0x2f, 0x5e, 0xbc, 0x63, 0xc6, 0x97, 0x35, 0x6a, 0xd4, 0xb3, 0x7d, 0xfa, 0xef, 
-  0xc5, 0x91, 0x39, 0x72, 0xe4, 0xd3, 0xbd, 0x61, 0xc2, 0x9f, 0x25, 0x4a, 0x94, 0x33, 0x66, 0xcc, 
-  0x83, 0x1d, 0x3a, 0x74, 0xe8, 0xcb, 0x8d, 0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, 0x80, 0x1b, 
-  0x36, 0x6c, 0xd8, 0xab, 0x4d, 0x9a, 0x2f, 0x5e, 0xbc, 0x63, 0xc6, 0x97, 0x35, 0x6a, 0xd4, 0xb3, 
-  0x7d, 0xfa, 0xef, 0xc5, 0x91, 0x39, 0x72, 0xe4, 0xd3, 0xbd, 0x61, 0xc2, 0x9f, 0x25, 0x4a, 0x94, 
-  0x33, 0x66, 0xcc, 0x83, 0x1d, 0x3a, 0x74, 0xe8, 0xcb, 0x8d, 0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 
-  0x40, 0x80, 0x1b, 0x36, 0x6c, 0xd8, 0xab, 0x4d, 0x9a, 0x2f, 0x5e, 0xbc, 0x63, 0xc6, 0x97, 0x35, 
-  0x6a, 0xd4, 0xb3, 0x7d, 0xfa, 0xef, 0xc5, 0x91, 0x39, 0x72, 0xe4, 0xd3, 0xbd, 0x61, 0xc2, 0x9f, 
-  0x25, 0x4a, 0x94, 0x33, 0x66, 0xcc, 0x83, 0x1d, 0x3a, 0x74, 0xe8, 0xcb, 0x8d, 0x01, 0x02, 0x04, 
-  0x08, 0x10, 0x20, 0x40, 0x80, 0x1b, 0x36, 0x6c, 0xd8, 0xab, 0x4d, 0x9a, 0x2f, 0x5e, 0xbc, 0x63, 
-  0xc6, 0x97, 0x35, 0x6a, 0xd4, 0xb3, 0x7d, 0xfa, 0xef, 0xc5, 0x91, 0x39, 0x72, 0xe4, 0xd3, 0xbd, 
-  0x61, 0xc2, 0x9f, 0x25, 0x4a, 0x94, 0x33, 0x66, 0xcc, 0x83, 0x1d, 0x3a, 0x74, 0xe8, 0xcb  };
+// x to the power (i-1) being powers of x (x is denoted as {02}) in the field GF(2^8)
+// Note that i starts at 1, not 0). Only Rcon[1..10] are used for AES128.
+static const uint8_t Rcon[11] = {
+  0x8d, 0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, 0x80, 0x1b, 0x36 };
+
+#endif
 
 
 /*****************************************************************************/
 /* Private functions:                                                        */
 /*****************************************************************************/
+#if COMPUTE_TABLES || defined(AES128_TEST_TABLES)
+
+#define ROTL8(x, shift) ((uint8_t)((x) << (shift)) | ((x) >> (8 - (shift))))
+
+// Fills s, rs and rc with the S-box, inverse S-box and Rcon. p walks through all non-zero
+// elements of GF(2^8) as powers of the generator 3 while q walks through their inverses,
+// the S-box entry of p is the affine transformation of q.
+static void ComputeTables(uint8_t* s, uint8_t* rs, uint8_t* rc)
+{
+  uint8_t p = 1, q = 1, x;
+  uint8_t i;
+
+  do
+  {
+    // p * 3
+    p = p ^ (uint8_t)(p << 1) ^ ((p & 0x80) ? 0x1b : 0);
+
+    // q / 3
+    q ^= (uint8_t)(q << 1);
+    q ^= (uint8_t)(q << 2);
+    q ^= (uint8_t)(q << 4);
+    q ^= (q & 0x80) ? 0x09 : 0;
+
+    x = q ^ ROTL8(q, 1) ^ ROTL8(q, 2) ^ ROTL8(q, 3) ^ ROTL8(q, 4);
+    s[p] = x ^ 0x63;
+    rs[x ^ 0x63] = p;
+  } while(p != 1);
+
+  // 0 has no inverse and is special-cased
+  s[0] = 0x63;
+  rs[0x63] = 0;
+
+  rc[0] = 0x8d;
+  for(i = 1; i < 11; ++i)
+  {
+    rc[i] = (uint8_t)(rc[i - 1] << 1) ^ ((rc[i - 1] & 0x80) ? 0x1b : 0);
+  }
+}
+
+#endif
+
+#if COMPUTE_TABLES
+
+// Computes the tables exactly once, also when several threads get here at the same time:
+// the first one fills them, the others wait until it is done. Without GCC atomics the
+// library has to be used from one thread only in this build.
+#if defined(__GNUC__)
+  #define TABLES_LOAD()      __atomic_load_n(&tables_state, __ATOMIC_ACQUIRE)
+  #define TABLES_STORE(v)    __atomic_store_n(&tables_state, (v), __ATOMIC_RELEASE)
+  #define TABLES_CLAIM(old)  __atomic_compare_exchange_n(&tables_state, &(old), 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)
+#else
+  #define TABLES_LOAD()      (tables_state)
+  #define TABLES_STORE(v)    (tables_state = (v))
+  #define TABLES_CLAIM(old)  ((void)(old), tables_state = 1)
+#endif
+
+static void InitTables(void)
+{
+  uint8_t unclaimed = 0;
+
+  if(TABLES_CLAIM(unclaimed))
+  {
+    ComputeTables(sbox, rsbox, Rcon);
+    TABLES_STORE(2);
+  }
+  else
+  {
+    while(TABLES_LOAD() != 2)
+    {
+    }
+  }
+}
+
+// At the top of every public function that reaches the tables, so the rounds themselves
+// do not test for them.
+#define INIT_TABLES() do { if(TABLES_LOAD() != 2) { InitTables(); } } while(0)
+
+#else
+
+#define INIT_TABLES()
+
+#endif
+
+#if AES128_STATS
+static void StatAdd(uint8_t stat, uint64_t n)
+{
+  if(StatShardIndex == 0)
+  {
+    StatShardIndex = __atomic_fetch_add(&StatNextShard, 1, __ATOMIC_RELAXED) % AES128_STATS_SHARDS + 1;
+  }
+  __atomic_fetch_add(&StatShard[StatShardIndex - 1].counter[stat], n, __ATOMIC_RELAXED);
+  if(StatFlow != 0)
+  {
+    __atomic_fetch_add(&StatFlow->counter[stat], n, __ATOMIC_RELAXED);
+  }
+}
+#endif
+
+#if AES128_STAGE_TIMING && !(defined(__x86_64__) || defined(__i386__))
+static uint64_t StageNanoseconds(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+#endif
+
 
 void _SAND(uint8_t p1, uint8_t p2, uint8_t q1, uint8_t q2, uint8_t * zr, uint8_t * zrm)
 {
@@ -558,11 +785,13 @@ static uint8_t getSBoxInvert(uint8_t num)
 }
 
 // This function produces Nb(Nr+1) round keys. The round keys are used in each round to decrypt the states. 
-static void KeyExpansion(void)
+static void KeyExpansion(uint8_t* RoundKey, const uint8_t* Key)
 {
   uint32_t i, j, k;
   uint8_t tempa[4]; // Used for the column/row operations
-  
+
+  STAT_ADD(AES128_STAT_KEY_EXPANSIONS, 1);
+
   // The first round key is the key itself.
   for(i = 0; i < Nk; ++i)
   {
@@ -623,9 +852,98 @@ static void KeyExpansion(void)
   }
 }
 
+// Expands a batch of keys a round at a time, KEY_BATCH keys in flight.
+// The S-box lookups of the different keys are independent, so they overlap instead of
+// forming one long dependency chain like in KeyExpansion().
+#define KEY_BATCH 4
+static void KeyExpansionBatch(AES128_key_t* ctx, const uint8_t* keys, uint32_t count)
+{
+  uint32_t n, lanes, l;
+  uint8_t round, i;
+  const uint8_t* prev;
+  uint8_t* rk;
+
+  STAT_ADD(AES128_STAT_KEY_EXPANSIONS, count);
+
+  for(n = 0; n < count; n += lanes)
+  {
+    lanes = (count - n < KEY_BATCH) ? count - n : KEY_BATCH;
+
+    // The first round key is the key itself.
+    for(l = 0; l < lanes; ++l)
+    {
+      memcpy(ctx[n + l].RoundKey, keys + (n + l) * KEYLEN, KEYLEN);
+    }
+
+    for(round = 1; round <= Nr; ++round)
+    {
+      for(l = 0; l < lanes; ++l)
+      {
+        prev = ctx[n + l].RoundKey + (round - 1) * KEYLEN;
+        rk = ctx[n + l].RoundKey + round * KEYLEN;
+
+        // RotWord, SubWord and Rcon on the last word of the previous round key
+        rk[0] = prev[0] ^ getSBoxValue(prev[13]) ^ Rcon[round];
+        rk[1] = prev[1] ^ getSBoxValue(prev[14]);
+        rk[2] = prev[2] ^ getSBoxValue(prev[15]);
+        rk[3] = prev[3] ^ getSBoxValue(prev[12]);
+        for(i = 4; i < KEYLEN; ++i)
+        {
+          rk[i] = prev[i] ^ rk[i - 4];
+        }
+      }
+    }
+  }
+}
+
+// Turns round key round-1 in RoundKey into round key round, in place.
+static void NextRoundKey(uint8_t* RoundKey, uint8_t round)
+{
+  uint8_t i;
+
+  // RotWord, SubWord and Rcon on the last word of the previous round key
+  RoundKey[0] ^= getSBoxValue(RoundKey[13]) ^ Rcon[round];
+  RoundKey[1] ^= getSBoxValue(RoundKey[14]);
+  RoundKey[2] ^= getSBoxValue(RoundKey[15]);
+  RoundKey[3] ^= getSBoxValue(RoundKey[12]);
+  for(i = 4; i < KEYLEN; ++i)
+  {
+    RoundKey[i] ^= RoundKey[i - 4];
+  }
+}
+
+// The inverse of NextRoundKey(): turns round key round back into round key round-1.
+static void PrevRoundKey(uint8_t* RoundKey, uint8_t round)
+{
+  uint8_t i;
+
+  for(i = KEYLEN - 1; i >= 4; --i)
+  {
+    RoundKey[i] ^= RoundKey[i - 4];
+  }
+  RoundKey[0] ^= getSBoxValue(RoundKey[13]) ^ Rcon[round];
+  RoundKey[1] ^= getSBoxValue(RoundKey[14]);
+  RoundKey[2] ^= getSBoxValue(RoundKey[15]);
+  RoundKey[3] ^= getSBoxValue(RoundKey[12]);
+}
+
+// Computes the last round key, the starting point of InvCipherOnTheFly().
+static void LastRoundKey(uint8_t* RoundKey, const uint8_t* Key)
+{
+  uint8_t round;
+
+  STAT_ADD(AES128_STAT_DKEY_EXPANSIONS, 1);
+
+  memcpy(RoundKey, Key, KEYLEN);
+  for(round = 1; round <= Nr; ++round)
+  {
+    NextRoundKey(RoundKey, round);
+  }
+}
+
 // This function adds the round key to state.
 // The round key is added to the state by an XOR function.
-static void AddRoundKey(state_t * state, uint8_t round)
+static void AddRoundKey(state_t * state, uint8_t round, const uint8_t* RoundKey)
 {
   uint8_t i,j;
   for(i=0;i<4;++i)
@@ -800,27 +1118,43 @@ static void InvShiftRows(state_t * state)
 }
 
 
-// Cipher is the main function that encrypts the PlainText.
-static void Cipher(state_t * state)
+// Adds (or removes) the mask statem to the state.
+static void AddMask(state_t * state, const state_t * statem)
 {
-  uint8_t round = 0;
-  uint8_t rng[] = {0x13,0x05,0x59,0x81,0x49,0xaf,0xb3,0x30,0x29,0x11,0xc4,0xbb,0x91,0xe4,0x98,0x44};
-
-  state_t * statem = (state_t*)rng;
-
-  // add "random" mask
-  int i,j;
+  uint8_t i, j;
   for (i=0; i<4; i++)
   {
       for (j=0; j<4; j++)
       {
-          /*(*statem)[i][j] = 0;*/
           (*state)[i][j] ^= (*statem)[i][j];
       }
   }
+}
+
+static void BlockCopy(uint8_t* output, const uint8_t* input)
+{
+  uint8_t i;
+  for (i=0;i<KEYLEN;++i)
+  {
+    output[i] = input[i];
+  }
+}
+
+// Cipher is the main function that encrypts the PlainText.
+static void Cipher(state_t * state, const uint8_t* RoundKey)
+{
+  uint8_t round = 0;
+  uint8_t rng[] = {0x13,0x05,0x59,0x81,0x49,0xaf,0xb3,0x30,0x29,0x11,0xc4,0xbb,0x91,0xe4,0x98,0x44};
+
+  state_t * statem = (state_t*)rng;
+
+  STAT_ADD(AES128_STAT_STORED_SCHEDULE, 1);
+
+  // add "random" mask
+  TIMED(STAGE_MASK, AddMask(state, statem));
 
   // Add the First round key to the state before starting the rounds.
-  AddRoundKey(state,0); 
+  TIMED(STAGE_ADD_ROUND_KEY, AddRoundKey(state, 0, RoundKey));
 
   
   // There will be Nr rounds.
@@ -829,70 +1163,124 @@ static void Cipher(state_t * state)
   for(round = 1; round < Nr; ++round)
   {
 
-    SubBytesm(state,statem);
+    TIMED(STAGE_SUB_BYTES, SubBytesm(state, statem));
 
-    ShiftRows(state);
-    ShiftRows(statem);
+    TIMED(STAGE_SHIFT_ROWS, ShiftRows(state));
+    TIMED(STAGE_MASK, ShiftRows(statem));
 
-    MixColumns(state);
-    MixColumns(statem);
+    TIMED(STAGE_MIX_COLUMNS, MixColumns(state));
+    TIMED(STAGE_MASK, MixColumns(statem));
 
-    AddRoundKey(state,round);
+    TIMED(STAGE_ADD_ROUND_KEY, AddRoundKey(state, round, RoundKey));
   }
   
   // The last round is given below.
   // The MixColumns function is not here in the last round.
-  SubBytesm(state, statem);
+  TIMED(STAGE_SUB_BYTES, SubBytesm(state, statem));
 
-  ShiftRows(state);
-  ShiftRows(statem);
+  TIMED(STAGE_SHIFT_ROWS, ShiftRows(state));
+  TIMED(STAGE_MASK, ShiftRows(statem));
 
-  AddRoundKey(state,Nr);
+  TIMED(STAGE_ADD_ROUND_KEY, AddRoundKey(state, Nr, RoundKey));
 
   // remove mask
-  for (i=0; i<4; i++)
+  TIMED(STAGE_MASK, AddMask(state, statem));
+}
+
+#if KEY_SCHEDULE_ON_THE_FLY && defined(ECB) && ECB
+// Cipher with the round keys derived from Key while the rounds go, see NextRoundKey().
+static void CipherOnTheFly(state_t * state, const uint8_t* Key)
+{
+  uint8_t round = 0;
+  uint8_t rng[] = {0x13,0x05,0x59,0x81,0x49,0xaf,0xb3,0x30,0x29,0x11,0xc4,0xbb,0x91,0xe4,0x98,0x44};
+  uint8_t RoundKey[KEYLEN];
+
+  state_t * statem = (state_t*)rng;
+
+  STAT_ADD(AES128_STAT_ON_THE_FLY, 1);
+
+  TIMED(STAGE_MASK, AddMask(state, statem));
+
+  BlockCopy(RoundKey, Key);
+  TIMED(STAGE_ADD_ROUND_KEY, AddRoundKey(state, 0, RoundKey));
+
+  for(round = 1; round < Nr; ++round)
   {
-      for (j=0; j<4; j++)
-      {
-          (*state)[i][j] ^= (*statem)[i][j];
-      }
+    TIMED(STAGE_SUB_BYTES, SubBytesm(state, statem));
+
+    TIMED(STAGE_SHIFT_ROWS, ShiftRows(state));
+    TIMED(STAGE_MASK, ShiftRows(statem));
+
+    TIMED(STAGE_MIX_COLUMNS, MixColumns(state));
+    TIMED(STAGE_MASK, MixColumns(statem));
+
+    TIMED(STAGE_KEY_EXPANSION, NextRoundKey(RoundKey, round));
+    TIMED(STAGE_ADD_ROUND_KEY, AddRoundKey(state, 0, RoundKey));
   }
 
+  TIMED(STAGE_SUB_BYTES, SubBytesm(state, statem));
+
+  TIMED(STAGE_SHIFT_ROWS, ShiftRows(state));
+  TIMED(STAGE_MASK, ShiftRows(statem));
 
+  TIMED(STAGE_KEY_EXPANSION, NextRoundKey(RoundKey, Nr));
+  TIMED(STAGE_ADD_ROUND_KEY, AddRoundKey(state, 0, RoundKey));
+
+  TIMED(STAGE_MASK, AddMask(state, statem));
 }
+#endif
 
-static void InvCipher(state_t * state)
+static void InvCipher(state_t * state, const uint8_t* RoundKey)
 {
   uint8_t round=0;
 
+  STAT_ADD(AES128_STAT_STORED_SCHEDULE, 1);
+
   // Add the First round key to the state before starting the rounds.
-  AddRoundKey(state,Nr); 
+  TIMED(STAGE_ADD_ROUND_KEY, AddRoundKey(state, Nr, RoundKey));
 
   // There will be Nr rounds.
   // The first Nr-1 rounds are identical.
   // These Nr-1 rounds are executed in the loop below.
   for(round=Nr-1;round>0;round--)
   {
-    InvShiftRows(state);
-    InvSubBytes(state);
-    AddRoundKey(state,round);
-    InvMixColumns(state);
+    TIMED(STAGE_INV_SHIFT_ROWS, InvShiftRows(state));
+    TIMED(STAGE_INV_SUB_BYTES, InvSubBytes(state));
+    TIMED(STAGE_ADD_ROUND_KEY, AddRoundKey(state, round, RoundKey));
+    TIMED(STAGE_INV_MIX_COLUMNS, InvMixColumns(state));
   }
   
   // The last round is given below.
   // The MixColumns function is not here in the last round.
-  InvShiftRows(state);
-  InvSubBytes(state);
-  AddRoundKey(state,0);
+  TIMED(STAGE_INV_SHIFT_ROWS, InvShiftRows(state));
+  TIMED(STAGE_INV_SUB_BYTES, InvSubBytes(state));
+  TIMED(STAGE_ADD_ROUND_KEY, AddRoundKey(state, 0, RoundKey));
 }
 
-static void BlockCopy(uint8_t* output, const uint8_t* input)
+// InvCipher with the round keys derived backwards from the last round key LastKey.
+static void InvCipherOnTheFly(state_t * state, const uint8_t* LastKey)
 {
-  uint8_t i;
-  for (i=0;i<KEYLEN;++i)
+  uint8_t round;
+  uint8_t RoundKey[KEYLEN];
+
+  STAT_ADD(AES128_STAT_ON_THE_FLY, 1);
+
+  BlockCopy(RoundKey, LastKey);
+  TIMED(STAGE_ADD_ROUND_KEY, AddRoundKey(state, 0, RoundKey));
+
+  for(round = Nr - 1; round > 0; round--)
   {
-    output[i] = input[i];
+    TIMED(STAGE_INV_SHIFT_ROWS, InvShiftRows(state));
+    TIMED(STAGE_INV_SUB_BYTES, InvSubBytes(state));
+    TIMED(STAGE_KEY_EXPANSION, PrevRoundKey(RoundKey, round + 1));
+    TIMED(STAGE_ADD_ROUND_KEY, AddRoundKey(state, 0, RoundKey));
+    TIMED(STAGE_INV_MIX_COLUMNS, InvMixColumns(state));
   }
+
+  TIMED(STAGE_INV_SHIFT_ROWS, InvShiftRows(state));
+  TIMED(STAGE_INV_SUB_BYTES, InvSubBytes(state));
+  TIMED(STAGE_KEY_EXPANSION, PrevRoundKey(RoundKey, 1));
+  TIMED(STAGE_ADD_ROUND_KEY, AddRoundKey(state, 0, RoundKey));
 }
 
 
@@ -900,31 +1288,210 @@ static void BlockCopy(uint8_t* output, const uint8_t* input)
 /*****************************************************************************/
 /* Public functions:                                                         */
 /*****************************************************************************/
+void AES128_expand_key(AES128_key_t* ctx, const uint8_t* key)
+{
+  INIT_TABLES();
+  TIMED(STAGE_KEY_EXPANSION, KeyExpansion(ctx->RoundKey, key));
+}
+
+void AES128_expand_keys(AES128_key_t* ctx, const uint8_t* keys, uint32_t count)
+{
+  INIT_TABLES();
+  TIMED(STAGE_KEY_EXPANSION, KeyExpansionBatch(ctx, keys, count));
+}
+
+void AES128_expand_dkey(AES128_dkey_t* ctx, const uint8_t* key)
+{
+  INIT_TABLES();
+  TIMED(STAGE_KEY_EXPANSION, LastRoundKey(ctx->LastRoundKey, key));
+}
+
+void AES128_ECB_decrypt_dkey(const uint8_t* input, const AES128_dkey_t* ctx, uint8_t* output)
+{
+  INIT_TABLES();
+  STAT_ADD(AES128_STAT_ECB_DECRYPT_BLOCKS, 1);
+  STAT_ADD(AES128_STAT_ECB_DECRYPT_BYTES, KEYLEN);
+  BlockCopy(output, input);
+  InvCipherOnTheFly((state_t*)output, ctx->LastRoundKey);
+}
+
+void AES128_preload(const AES128_key_t* ctx)
+{
+  volatile uint8_t sink = 0;
+  uint16_t i;
+
+  INIT_TABLES();
+
+  // One read per 16 bytes, which covers every line of any cache line size in use
+  for(i = 0; i < 256; i += 16)
+  {
+    sink ^= sbox[i] ^ rsbox[i];
+  }
+  sink ^= Rcon[0];
+  if(ctx != 0)
+  {
+    for(i = 0; i < sizeof(ctx->RoundKey); i += 16)
+    {
+      sink ^= ctx->RoundKey[i];
+    }
+  }
+  (void)sink;
+}
+
+#if AES128_STATS
+
+void AES128_stats_snapshot(AES128_stats_t* stats)
+{
+  unsigned i, j;
+
+  memset(stats, 0, sizeof(*stats));
+  for(i = 0; i < AES128_STATS_SHARDS; ++i)
+  {
+    for(j = 0; j < AES128_STATS_COUNT; ++j)
+    {
+      stats->counter[j] += __atomic_load_n(&StatShard[i].counter[j], __ATOMIC_RELAXED);
+    }
+  }
+}
+
+void AES128_stats_flow(AES128_stats_t* flow)
+{
+  StatFlow = flow;
+}
+
+int AES128_stats_prometheus(const AES128_stats_t* stats, char* buf, uint32_t len)
+{
+  uint32_t used = 0;
+  uint8_t i;
+  int n;
+
+  for(i = 0; i < AES128_STATS_COUNT; ++i)
+  {
+    if(StatMetric[i].help != 0)
+    {
+      n = snprintf(buf + ((used < len) ? used : len), (used < len) ? len - used : 0, "# HELP %s %s\n# TYPE %s counter\n",
+                   StatMetric[i].name, StatMetric[i].help, StatMetric[i].name);
+      used += (n > 0) ? (uint32_t)n : 0;
+    }
+    n = snprintf(buf + ((used < len) ? used : len), (used < len) ? len - used : 0, "%s%s%s%s %llu\n", StatMetric[i].name,
+                 StatMetric[i].labels[0] ? "{" : "", StatMetric[i].labels, StatMetric[i].labels[0] ? "}" : "",
+                 (unsigned long long)stats->counter[i]);
+    used += (n > 0) ? (uint32_t)n : 0;
+  }
+  return (int)used;
+}
+
+#endif // #if AES128_STATS
+
+#if AES128_STAGE_TIMING
+
+void AES128_stage_report(void)
+{
+  uint64_t overhead = UINT64_MAX, t, total = 0, net[STAGES];
+  uint8_t i;
+  uint16_t n;
+
+  // The cheapest of many empty measurements is what every TIMED() adds to its stage
+  for(n = 0; n < 1000; ++n)
+  {
+    t = STAGE_CLOCK();
+    t = STAGE_CLOCK() - t;
+    overhead = (t < overhead) ? t : overhead;
+  }
+
+  for(i = 0; i < STAGES; ++i)
+  {
+    net[i] = StageTotal[i] - ((StageTotal[i] > overhead * StageCalls[i]) ? overhead * StageCalls[i] : StageTotal[i]);
+    total += net[i];
+  }
+
+  printf("%-14s %12s %14s %10s %6s\n", "stage", "calls", STAGE_UNIT, "per call", "%");
+  for(i = 0; i < STAGES; ++i)
+  {
+    if(StageCalls[i] != 0)
+    {
+      printf("%-14s %12llu %14llu %10.1f %6.1f\n", StageName[i],
+             (unsigned long long)StageCalls[i], (unsigned long long)net[i],
+             (double)net[i] / StageCalls[i], (total != 0) ? 100.0 * net[i] / total : 0.0);
+    }
+  }
+  printf("%-14s %12s %14llu %10s %6s  (timer overhead %llu %s per call subtracted)\n", "total", "",
+         (unsigned long long)total, "", "", (unsigned long long)overhead, STAGE_UNIT);
+}
+
+void AES128_stage_reset(void)
+{
+  memset(StageTotal, 0, sizeof(StageTotal));
+  memset(StageCalls, 0, sizeof(StageCalls));
+}
+
+#endif // #if AES128_STAGE_TIMING
+
+
 #if defined(ECB) && ECB
 
 
 void AES128_ECB_encrypt(const uint8_t* input, const uint8_t* key, uint8_t* output)
 {
+  INIT_TABLES();
+  STAT_ADD(AES128_STAT_ECB_ENCRYPT_BLOCKS, 1);
+  STAT_ADD(AES128_STAT_ECB_ENCRYPT_BYTES, KEYLEN);
+
   // Copy input to output, and work in-memory on output
   BlockCopy(output, input);
 
-  Key = key;
-  KeyExpansion();
+#if KEY_SCHEDULE_ON_THE_FLY
+  CipherOnTheFly((state_t*)output, key);
+#else
+  TIMED(STAGE_KEY_EXPANSION, KeyExpansion(CurrentKey.RoundKey, key));
 
   // The next function call encrypts the PlainText with the Key using AES algorithm.
-  Cipher((state_t*)output);
+  Cipher((state_t*)output, CurrentKey.RoundKey);
+#endif
 }
 
 void AES128_ECB_decrypt(const uint8_t* input, const uint8_t* key, uint8_t *output)
 {
+#if KEY_SCHEDULE_ON_THE_FLY
+  uint8_t LastKey[KEYLEN];
+#endif
+
+  INIT_TABLES();
+  STAT_ADD(AES128_STAT_ECB_DECRYPT_BLOCKS, 1);
+  STAT_ADD(AES128_STAT_ECB_DECRYPT_BYTES, KEYLEN);
+
   // Copy input to output, and work in-memory on output
   BlockCopy(output, input);
 
+#if KEY_SCHEDULE_ON_THE_FLY
+  TIMED(STAGE_KEY_EXPANSION, LastRoundKey(LastKey, key));
+  InvCipherOnTheFly((state_t*)output, LastKey);
+#else
   // The KeyExpansion routine must be called before encryption.
-  Key = key;
-  KeyExpansion();
+  TIMED(STAGE_KEY_EXPANSION, KeyExpansion(CurrentKey.RoundKey, key));
 
-  InvCipher((state_t*)output);
+  InvCipher((state_t*)output, CurrentKey.RoundKey);
+#endif
+}
+
+void AES128_ECB_encrypt_keyed(const uint8_t* input, const AES128_key_t* ctx, uint8_t* output)
+{
+  INIT_TABLES();
+  STAT_ADD(AES128_STAT_ECB_ENCRYPT_BLOCKS, 1);
+  STAT_ADD(AES128_STAT_ECB_ENCRYPT_BYTES, KEYLEN);
+  STAT_ADD(AES128_STAT_KEY_REUSES, 1);
+  BlockCopy(output, input);
+  Cipher((state_t*)output, ctx->RoundKey);
+}
+
+void AES128_ECB_decrypt_keyed(const uint8_t* input, const AES128_key_t* ctx, uint8_t* output)
+{
+  INIT_TABLES();
+  STAT_ADD(AES128_STAT_ECB_DECRYPT_BLOCKS, 1);
+  STAT_ADD(AES128_STAT_ECB_DECRYPT_BYTES, KEYLEN);
+  STAT_ADD(AES128_STAT_KEY_REUSES, 1);
+  BlockCopy(output, input);
+  InvCipher((state_t*)output, ctx->RoundKey);
 }
 
 
@@ -937,7 +1504,7 @@ void AES128_ECB_decrypt(const uint8_t* input, const uint8_t* key, uint8_t *outpu
 #if defined(CBC) && CBC
 
 
-static void XorWithIv(uint8_t* buf)
+static void XorWithIv(uint8_t* buf, const uint8_t* Iv)
 {
   uint8_t i;
   for(i = 0; i < KEYLEN; ++i)
@@ -951,15 +1518,21 @@ void AES128_CBC_encrypt_buffer(uint8_t* output, uint8_t* input, uint32_t length,
   uintptr_t i;
   uint8_t remainders = length % KEYLEN; /* Remaining bytes in the last non-full block */
 
+  INIT_TABLES();
   BlockCopy(output, input);
   state_t * state = (state_t*)output;
 
   // Skip the key expansion if key is passed as 0
   if(0 != key)
   {
-    Key = key;
-    KeyExpansion();
+    TIMED(STAGE_KEY_EXPANSION, KeyExpansion(CurrentKey.RoundKey, key));
+  }
+  else
+  {
+    STAT_ADD(AES128_STAT_KEY_REUSES, 1);
   }
+  STAT_ADD(AES128_STAT_CBC_ENCRYPT_BLOCKS, (length + KEYLEN - 1) / KEYLEN);
+  STAT_ADD(AES128_STAT_CBC_ENCRYPT_BYTES, length);
 
   if(iv != 0)
   {
@@ -968,10 +1541,11 @@ void AES128_CBC_encrypt_buffer(uint8_t* output, uint8_t* input, uint32_t length,
 
   for(i = 0; i < length; i += KEYLEN)
   {
-    XorWithIv(input);
+    // Xor on the output copy so the input is left untouched (it may be read-only)
     BlockCopy(output, input);
+    XorWithIv(output, Iv);
     state = (state_t*)output;
-    Cipher(state);
+    Cipher(state, CurrentKey.RoundKey);
     Iv = output;
     input += KEYLEN;
     output += KEYLEN;
@@ -982,7 +1556,7 @@ void AES128_CBC_encrypt_buffer(uint8_t* output, uint8_t* input, uint32_t length,
     BlockCopy(output, input);
     memset(output + remainders, 0, KEYLEN - remainders); /* add 0-padding */
     state = (state_t*)output;
-    Cipher(state);
+    Cipher(state, CurrentKey.RoundKey);
   }
 }
 
@@ -990,16 +1564,22 @@ void AES128_CBC_decrypt_buffer(uint8_t* output, uint8_t* input, uint32_t length,
 {
   uintptr_t i;
   uint8_t remainders = length % KEYLEN; /* Remaining bytes in the last non-full block */
-  
+
+  INIT_TABLES();
   BlockCopy(output, input);
   state_t * state = (state_t*)output;
 
   // Skip the key expansion if key is passed as 0
   if(0 != key)
   {
-    Key = key;
-    KeyExpansion();
+    TIMED(STAGE_KEY_EXPANSION, KeyExpansion(CurrentKey.RoundKey, key));
+  }
+  else
+  {
+    STAT_ADD(AES128_STAT_KEY_REUSES, 1);
   }
+  STAT_ADD(AES128_STAT_CBC_DECRYPT_BLOCKS, (length + KEYLEN - 1) / KEYLEN);
+  STAT_ADD(AES128_STAT_CBC_DECRYPT_BYTES, length);
 
   // If iv is passed as 0, we continue to encrypt without re-setting the Iv
   if(iv != 0)
@@ -1011,8 +1591,8 @@ void AES128_CBC_decrypt_buffer(uint8_t* output, uint8_t* input, uint32_t length,
   {
     BlockCopy(output, input);
     state = (state_t*)output;
-    InvCipher(state);
-    XorWithIv(output);
+    InvCipher(state, CurrentKey.RoundKey);
+    XorWithIv(output, Iv);
     Iv = input;
     input += KEYLEN;
     output += KEYLEN;
@@ -1023,7 +1603,121 @@ void AES128_CBC_decrypt_buffer(uint8_t* output, uint8_t* input, uint32_t length,
     BlockCopy(output, input);
     memset(output+remainders, 0, KEYLEN - remainders); /* add 0-padding */
     state = (state_t*)output;
-    InvCipher(state);
+    InvCipher(state, CurrentKey.RoundKey);
+  }
+}
+
+
+static void CBC_encrypt_packet(const AES128_packet_t* packet, const uint8_t* RoundKey)
+{
+  uint32_t i;
+  const uint8_t* input = packet->input;
+  uint8_t* output = packet->output;
+  const uint8_t* iv = packet->iv;
+  uint8_t block[KEYLEN];
+
+  STAT_ADD(AES128_STAT_CBC_ENCRYPT_BLOCKS, (packet->length + KEYLEN - 1) / KEYLEN);
+  STAT_ADD(AES128_STAT_CBC_ENCRYPT_BYTES, packet->length);
+
+  for(i = 0; i < packet->length; i += KEYLEN)
+  {
+    if(packet->length - i < KEYLEN)
+    {
+      // Last partial block, 0-padded
+      memset(block, 0, KEYLEN);
+      memcpy(block, input, packet->length - i);
+      input = block;
+    }
+    BlockCopy(output, input);
+    XorWithIv(output, iv);
+    Cipher((state_t*)output, RoundKey);
+    iv = output;
+    input += KEYLEN;
+    output += KEYLEN;
+  }
+}
+
+static void CBC_decrypt_packet(const AES128_packet_t* packet, const uint8_t* RoundKey)
+{
+  uint32_t i;
+  const uint8_t* input = packet->input;
+  uint8_t* output = packet->output;
+  uint8_t prev[KEYLEN];
+  uint8_t next[KEYLEN];
+
+  STAT_ADD(AES128_STAT_CBC_DECRYPT_BLOCKS, (packet->length + KEYLEN - 1) / KEYLEN);
+  STAT_ADD(AES128_STAT_CBC_DECRYPT_BYTES, packet->length);
+
+  BlockCopy(prev, packet->iv);
+
+  for(i = 0; i < packet->length; i += KEYLEN)
+  {
+    // Keep the ciphertext block for chaining, output may overwrite it
+    BlockCopy(next, input);
+    BlockCopy(output, input);
+    InvCipher((state_t*)output, RoundKey);
+    XorWithIv(output, prev);
+    BlockCopy(prev, next);
+    input += KEYLEN;
+    output += KEYLEN;
+  }
+}
+
+void AES128_CBC_encrypt_packets(const AES128_packet_t* packets, uint32_t count, const uint8_t* key)
+{
+  uint32_t n;
+
+  INIT_TABLES();
+  TIMED(STAGE_KEY_EXPANSION, KeyExpansion(CurrentKey.RoundKey, key));
+
+  for(n = 0; n < count; ++n)
+  {
+    if(n != 0)
+    {
+      STAT_ADD(AES128_STAT_KEY_REUSES, 1);
+    }
+    CBC_encrypt_packet(&packets[n], CurrentKey.RoundKey);
+  }
+}
+
+void AES128_CBC_decrypt_packets(const AES128_packet_t* packets, uint32_t count, const uint8_t* key)
+{
+  uint32_t n;
+
+  INIT_TABLES();
+  TIMED(STAGE_KEY_EXPANSION, KeyExpansion(CurrentKey.RoundKey, key));
+
+  for(n = 0; n < count; ++n)
+  {
+    if(n != 0)
+    {
+      STAT_ADD(AES128_STAT_KEY_REUSES, 1);
+    }
+    CBC_decrypt_packet(&packets[n], CurrentKey.RoundKey);
+  }
+}
+
+void AES128_CBC_encrypt_keyed_packets(const AES128_packet_t* packets, uint32_t count)
+{
+  uint32_t n;
+
+  INIT_TABLES();
+  for(n = 0; n < count; ++n)
+  {
+    STAT_ADD(AES128_STAT_KEY_REUSES, 1);
+    CBC_encrypt_packet(&packets[n], packets[n].key->RoundKey);
+  }
+}
+
+void AES128_CBC_decrypt_keyed_packets(const AES128_packet_t* packets, uint32_t count)
+{
+  uint32_t n;
+
+  INIT_TABLES();
+  for(n = 0; n < count; ++n)
+  {
+    STAT_ADD(AES128_STAT_KEY_REUSES, 1);
+    CBC_decrypt_packet(&packets[n], packets[n].key->RoundKey);
   }
 }
 
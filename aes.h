@@ -9,6 +9,40 @@
 // CBC enables AES128 encryption in CBC-mode of operation and handles 0-padding.
 // ECB enables the basic ECB 16-byte block algorithm. Both can be enabled simultaneously.
 
+// Footprint profiles set the macros below and the ones at the top of aes.c together.
+// Define one of them at compile time, single macros defined as well still take precedence.
+//
+// AES128_PROFILE_TINY   ECB only, tables computed into RAM, Multiply as a function: least ROM.
+// AES128_PROFILE_SMALL  ECB and CBC, Multiply as a function.
+// AES128_PROFILE_FAST   ECB and CBC, constant tables and inlined Multiply (build with -O2).
+//                       These are the defaults, the profile pins them for the measurement.
+//
+// There is no constant-time profile: only the encryption rounds use the masked S-box circuit,
+// the key schedule and the decryption rounds look up tables indexed by secret bytes in every
+// configuration.
+#if defined(AES128_PROFILE_TINY)
+  #ifndef CBC
+    #define CBC 0
+  #endif
+  #ifndef COMPUTE_TABLES
+    #define COMPUTE_TABLES 1
+  #endif
+  #ifndef MULTIPLY_AS_A_FUNCTION
+    #define MULTIPLY_AS_A_FUNCTION 1
+  #endif
+#elif defined(AES128_PROFILE_SMALL)
+  #ifndef MULTIPLY_AS_A_FUNCTION
+    #define MULTIPLY_AS_A_FUNCTION 1
+  #endif
+#elif defined(AES128_PROFILE_FAST)
+  #ifndef COMPUTE_TABLES
+    #define COMPUTE_TABLES 0
+  #endif
+  #ifndef MULTIPLY_AS_A_FUNCTION
+    #define MULTIPLY_AS_A_FUNCTION 0
+  #endif
+#endif
+
 // The #ifndef-guard allows it to be configured before #include'ing or at compile time.
 #ifndef CBC
   #define CBC 1
@@ -19,12 +53,138 @@
 #endif
 
 
+// Define AES128_STAGE_TIMING to 1 for an instrumentation build that counts the time spent
+// in every stage of the cipher, see AES128_stage_report(). Not for production: each stage
+// is wrapped in two timer reads, and the totals are shared by all threads without locking.
+#ifndef AES128_STAGE_TIMING
+  #define AES128_STAGE_TIMING 0
+#endif
+
+// Define AES128_STATS to 1 to count blocks, bytes, key expansions and the cipher paths taken,
+// see AES128_stats_snapshot(). The counters are sharded over cache lines, every thread adds
+// to its own shard with relaxed atomics, so this needs GCC or Clang and thread-local storage.
+#ifndef AES128_STATS
+  #define AES128_STATS 0
+#endif
+
+// Cache line size that the lookup tables and expanded keys are aligned to, so that none of
+// them straddles more lines than it has to. 0 disables the alignment, the default on AVR.
+#ifndef AES128_CACHE_LINE
+  #if defined(__AVR__)
+    #define AES128_CACHE_LINE 0
+  #else
+    #define AES128_CACHE_LINE 64
+  #endif
+#endif
+
+#if AES128_CACHE_LINE && defined(__GNUC__)
+  #define AES128_ALIGNED __attribute__((aligned(AES128_CACHE_LINE)))
+#else
+  #define AES128_ALIGNED
+#endif
+
+// Alignment to give posix_memalign() for arrays of AES128_key_t and for buffers that should
+// start on a cache line. Never below sizeof(void*), the least posix_memalign() accepts.
+#if AES128_CACHE_LINE
+  #define AES128_KEY_ALIGN AES128_CACHE_LINE
+#else
+  #define AES128_KEY_ALIGN sizeof(void*)
+#endif
+
+// An expanded key: the Nb*(Nr+1) = 176 bytes of round keys, starting on a cache line.
+// Expand a key once with AES128_expand_key() and use it for any number of packets.
+// With 64 byte lines the struct is 192 bytes, the least that keeps every key of an array
+// on its own three lines; the 16 bytes of padding are never read or written.
+typedef struct
+{
+  uint8_t RoundKey[176];
+} AES128_ALIGNED AES128_key_t;
+
+void AES128_expand_key(AES128_key_t* ctx, const uint8_t* key);
+
+// Expands count keys stored back to back (16 bytes each) into ctx[0..count-1].
+// Faster per key than AES128_expand_key() when many keys are set up at once.
+void AES128_expand_keys(AES128_key_t* ctx, const uint8_t* keys, uint32_t count);
+
+// A decryption key for AES128_ECB_decrypt_dkey(): only the last round key, the others are
+// derived from it backwards while decrypting. 16 bytes per key instead of 176.
+typedef struct
+{
+  uint8_t LastRoundKey[16];
+} AES128_dkey_t;
+
+void AES128_expand_dkey(AES128_dkey_t* ctx, const uint8_t* key);
+
+// Decrypts one block with a key from AES128_expand_dkey(), in every build, also with ECB=0.
+void AES128_ECB_decrypt_dkey(const uint8_t* input, const AES128_dkey_t* ctx, uint8_t* output);
+
+// Touches every cache line of the lookup tables, and of ctx unless it is 0, so that the
+// first block of a batch after an idle period does not wait for them one miss at a time.
+void AES128_preload(const AES128_key_t* ctx);
+
+
+// The counters of AES128_STATS. Bytes are message bytes before padding.
+enum
+{
+  AES128_STAT_ECB_ENCRYPT_BLOCKS,
+  AES128_STAT_ECB_DECRYPT_BLOCKS,
+  AES128_STAT_CBC_ENCRYPT_BLOCKS,
+  AES128_STAT_CBC_DECRYPT_BLOCKS,
+  AES128_STAT_ECB_ENCRYPT_BYTES,
+  AES128_STAT_ECB_DECRYPT_BYTES,
+  AES128_STAT_CBC_ENCRYPT_BYTES,
+  AES128_STAT_CBC_DECRYPT_BYTES,
+  AES128_STAT_KEY_EXPANSIONS,       // full key schedules computed
+  AES128_STAT_DKEY_EXPANSIONS,      // last round keys computed, for AES128_dkey_t and on-the-fly decryption
+  AES128_STAT_KEY_REUSES,           // messages processed with a schedule expanded earlier
+  AES128_STAT_STORED_SCHEDULE,      // blocks ciphered with all round keys in memory
+  AES128_STAT_ON_THE_FLY,           // blocks ciphered with the round keys derived on the way
+  AES128_STATS_COUNT
+};
+
+typedef struct
+{
+  uint64_t counter[AES128_STATS_COUNT];
+} AES128_stats_t;
+
+#if AES128_STATS
+
+// Sums the counters of all threads into stats. Counters only grow, rates are the
+// difference of two snapshots.
+void AES128_stats_snapshot(AES128_stats_t* stats);
+
+// Counts what the calling thread does from now on into flow as well, until it calls this
+// again with 0, e.g. around the calls for the packets of one flow. Several threads may
+// count into the same flow.
+void AES128_stats_flow(AES128_stats_t* flow);
+
+// Formats stats, from AES128_stats_snapshot() or of a flow from AES128_stats_flow(), in the
+// Prometheus text exposition format. Returns the length of the whole text like snprintf(),
+// which is only complete in buf if that is less than len.
+int AES128_stats_prometheus(const AES128_stats_t* stats, char* buf, uint32_t len);
+
+#endif // #if AES128_STATS
+
+#if AES128_STAGE_TIMING
+
+// Prints calls, total and average time of every stage since the start or the last
+// AES128_stage_reset(), in TSC cycles on x86 and in nanoseconds elsewhere. The cost of
+// the timer reads themselves is measured and subtracted.
+void AES128_stage_report(void);
+void AES128_stage_reset(void);
+
+#endif // #if AES128_STAGE_TIMING
+
 
 #if defined(ECB) && ECB
 
 void AES128_ECB_encrypt(const uint8_t* input, const uint8_t* key, uint8_t *output);
 void AES128_ECB_decrypt(const uint8_t* input, const uint8_t* key, uint8_t *output);
 
+// Same as above with a key expanded once by AES128_expand_key(), for many blocks under one key.
+void AES128_ECB_encrypt_keyed(const uint8_t* input, const AES128_key_t* ctx, uint8_t* output);
+void AES128_ECB_decrypt_keyed(const uint8_t* input, const AES128_key_t* ctx, uint8_t* output);
+
 #endif // #if defined(ECB) && ECB
 
 
@@ -33,6 +193,25 @@ void AES128_ECB_decrypt(const uint8_t* input, const uint8_t* key, uint8_t *outpu
 void AES128_CBC_encrypt_buffer(uint8_t* output, uint8_t* input, uint32_t length, const uint8_t* key, const uint8_t* iv);
 void AES128_CBC_decrypt_buffer(uint8_t* output, uint8_t* input, uint32_t length, const uint8_t* key, const uint8_t* iv);
 
+// Packet descriptor for the batch functions below. Each packet has its own IV, output may equal input.
+// Encryption 0-pads the last block like the buffer functions, decryption expects whole blocks.
+typedef struct
+{
+  const uint8_t* input;
+  uint8_t* output;
+  uint32_t length;
+  const uint8_t* iv;
+  const AES128_key_t* key;  // only used by the _keyed_packets functions
+} AES128_packet_t;
+
+// Encrypts/decrypts a burst of packets under one key, the key is expanded once for the whole batch.
+void AES128_CBC_encrypt_packets(const AES128_packet_t* packets, uint32_t count, const uint8_t* key);
+void AES128_CBC_decrypt_packets(const AES128_packet_t* packets, uint32_t count, const uint8_t* key);
+
+// Same for packets of many flows, each packet is processed with its own pre-expanded key.
+void AES128_CBC_encrypt_keyed_packets(const AES128_packet_t* packets, uint32_t count);
+void AES128_CBC_decrypt_keyed_packets(const AES128_packet_t* packets, uint32_t count);
+
 #endif // #if defined(CBC) && CBC
 
 
@@ -0,0 +1,650 @@
+/*
+
+aescrypt - command line front-end for the AES128 ECB and CBC buffer functions.
+
+  aescrypt [-d] [-m ecb|cbc] [-K] [-M [-t N] | -p [-b BYTES]] -k KEY [-i IV] INPUT [OUTPUT]
+
+  -d        decrypt instead of encrypt
+  -m MODE   ecb or cbc (default cbc)
+  -k KEY    128 bit key as 32 hex digits
+  -i IV     128 bit IV as 32 hex digits (CBC only, default all zero)
+  -K        use the kernel's AES through AF_ALG (afalg.h) instead of aes.c
+  -M        memory-map the files instead of copying through read/write buffers
+  -t N      threads of the memory-mapped mode (default: online CPUs)
+  -p        run reading, encryption and writing as pipelined threads
+  -b BYTES  buffer memory of the pipeline, suffix k or m allowed (default 2m)
+
+Without -M the data is copied through a small buffer, and INPUT and OUTPUT may be
+"-" for stdin and stdout.
+
+With -p the stream is processed by pipeline_run() (see pipeline.h): reading,
+encryption and writing overlap, and memory use stays at BYTES however long
+the stream is. INPUT and OUTPUT may be "-" here as well.
+
+With -M the files are memory-mapped and processed directly in the mapping, one
+window at a time, so files larger than RAM can be processed. If OUTPUT is omitted
+the file is transformed in-place. Each window is split into page-aligned chunks that N
+threads process at once with the keyed functions: ECB in both directions, and
+CBC decryption, where a chunk only needs the ciphertext block before it as its IV.
+CBC encryption chains every block on the one before, so it is the one mode that stays
+on a single thread, as does -K.
+
+Encryption zero-pads the last block (like AES128_CBC_encrypt_buffer does), so the
+output is rounded up to a multiple of 16 bytes. Decryption expects whole blocks
+and does not strip the padding.
+
+*/
+
+
+/*****************************************************************************/
+/* Includes:                                                                 */
+/*****************************************************************************/
+#define _FILE_OFFSET_BITS 64
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "aes.h"
+#include "afalg.h"
+#include "pipeline.h"
+
+
+/*****************************************************************************/
+/* Defines:                                                                  */
+/*****************************************************************************/
+#define BLOCKLEN 16
+
+// Size of the read/write buffer used when not memory-mapping.
+#define STREAM_BUFLEN (16 * 1024)
+
+// Default buffer memory of the pipelined mode.
+#define PIPELINE_MEMORY (2UL * 1024 * 1024)
+
+// Size of the mapped window. Must be a multiple of the page size (and thereby of BLOCKLEN).
+#ifndef MMAP_WINDOW
+  #define MMAP_WINDOW (64UL * 1024 * 1024)
+#endif
+
+// Most threads of the memory-mapped mode.
+#define MAX_THREADS 64
+
+enum { MODE_ECB, MODE_CBC };
+
+
+/*****************************************************************************/
+/* Private variables:                                                        */
+/*****************************************************************************/
+struct job
+{
+  int mode;
+  int decrypt;
+  uint8_t key[BLOCKLEN];
+  uint8_t iv[BLOCKLEN];     // chaining value carried from one chunk to the next
+  const uint8_t* keyp;      // key for the next CBC call, 0 once it has been expanded
+  AES128_key_t ctx;         // the expanded key of the ECB and parallel CBC calls
+  int threads;              // of the memory-mapped mode
+  int use_afalg;
+  afalg_t afalg;
+};
+
+// A page-aligned part of a window, processed by one thread of the memory-mapped mode.
+struct chunk
+{
+  const struct job* job;
+  uint8_t* out;
+  const uint8_t* in;
+  size_t len;
+  uint8_t iv[BLOCKLEN];     // CBC decryption: the ciphertext block before the chunk
+  pthread_t thread;
+  int started;
+};
+
+
+/*****************************************************************************/
+/* Private functions:                                                        */
+/*****************************************************************************/
+static void usage(void)
+{
+  fprintf(stderr, "usage: aescrypt [-d] [-m ecb|cbc] [-K] [-M [-t N] | -p [-b BYTES]] -k KEY [-i IV] INPUT [OUTPUT]\n");
+  exit(2);
+}
+
+static int parse_hex(uint8_t* out, const char* hex)
+{
+  unsigned int i, v;
+  if(strlen(hex) != 2 * BLOCKLEN)
+  {
+    return -1;
+  }
+  for(i = 0; i < BLOCKLEN; ++i)
+  {
+    if(sscanf(hex + 2 * i, "%2x", &v) != 1)
+    {
+      return -1;
+    }
+    out[i] = (uint8_t)v;
+  }
+  return 0;
+}
+
+// Encrypts or decrypts len bytes, len must be a multiple of BLOCKLEN.
+// out may be equal to in.
+static void crypt_blocks(struct job* job, uint8_t* out, uint8_t* in, size_t len)
+{
+  uint8_t next[BLOCKLEN];
+  size_t i;
+
+  if(len == 0)
+  {
+    return;
+  }
+
+  if(job->use_afalg)
+  {
+    if(afalg_crypt(&job->afalg, job->decrypt, out, in, len, job->iv) != 0)
+    {
+      perror("aescrypt: AF_ALG");
+      exit(1);
+    }
+    return;
+  }
+
+  if(job->mode == MODE_ECB)
+  {
+    for(i = 0; i < len; i += BLOCKLEN)
+    {
+      if(job->decrypt)
+      {
+        AES128_ECB_decrypt_keyed(in + i, &job->ctx, out + i);
+      }
+      else
+      {
+        AES128_ECB_encrypt_keyed(in + i, &job->ctx, out + i);
+      }
+    }
+    return;
+  }
+
+  if(!job->decrypt)
+  {
+    AES128_CBC_encrypt_buffer(out, in, len, job->keyp, job->iv);
+    memcpy(job->iv, out + len - BLOCKLEN, BLOCKLEN);
+  }
+  else if(out != in)
+  {
+    memcpy(next, in + len - BLOCKLEN, BLOCKLEN);
+    AES128_CBC_decrypt_buffer(out, in, len, job->keyp, job->iv);
+    memcpy(job->iv, next, BLOCKLEN);
+  }
+  else
+  {
+    // CBC decryption chains on the previous ciphertext block, which in-place
+    // decryption has already overwritten - so go one block at a time.
+    for(i = 0; i < len; i += BLOCKLEN)
+    {
+      memcpy(next, in + i, BLOCKLEN);
+      AES128_CBC_decrypt_buffer(out + i, in + i, BLOCKLEN, job->keyp, job->iv);
+      memcpy(job->iv, next, BLOCKLEN);
+      job->keyp = 0;
+    }
+  }
+  // The key schedule is kept between calls, don't expand it again.
+  job->keyp = 0;
+}
+
+// Processes the last, partial block of an encryption with zero-padding.
+static void crypt_tail(struct job* job, uint8_t* out, const uint8_t* in, size_t len)
+{
+  uint8_t block[BLOCKLEN];
+
+  memset(block, 0, BLOCKLEN);
+  memcpy(block, in, len);
+  crypt_blocks(job, out, block, BLOCKLEN);
+}
+
+static int run_stream(struct job* job, const char* inpath, const char* outpath)
+{
+  static uint8_t buf[STREAM_BUFLEN];
+  FILE* in = stdin;
+  FILE* out = stdout;
+  size_t n, full;
+  int rc = 0;
+
+  if(strcmp(inpath, "-") != 0 && (in = fopen(inpath, "rb")) == NULL)
+  {
+    perror(inpath);
+    return 1;
+  }
+  if(strcmp(outpath, "-") != 0 && (out = fopen(outpath, "wb")) == NULL)
+  {
+    perror(outpath);
+    if(in != stdin)
+    {
+      fclose(in);
+    }
+    return 1;
+  }
+
+  // fread only returns a short count at end of file, so only the last chunk can hold a partial block.
+  while((n = fread(buf, 1, STREAM_BUFLEN, in)) > 0)
+  {
+    full = n - (n % BLOCKLEN);
+    crypt_blocks(job, buf, buf, full);
+    if(full != n)
+    {
+      if(job->decrypt)
+      {
+        fprintf(stderr, "aescrypt: input is not a multiple of %d bytes\n", BLOCKLEN);
+        rc = 1;
+        break;
+      }
+      crypt_tail(job, buf + full, buf + full, n - full);
+      full += BLOCKLEN;
+    }
+    if(fwrite(buf, 1, full, out) != full)
+    {
+      perror(outpath);
+      rc = 1;
+      break;
+    }
+  }
+  if(ferror(in))
+  {
+    perror(inpath);
+    rc = 1;
+  }
+
+  if(in != stdin)
+  {
+    fclose(in);
+  }
+  if(out != stdout && fclose(out) != 0)
+  {
+    perror(outpath);
+    rc = 1;
+  }
+  return rc;
+}
+
+// Transform stage of the pipelined mode.
+static size_t pipeline_crypt(void* arg, uint8_t* buf, size_t len, int last)
+{
+  struct job* job = arg;
+  size_t full = len - (len % BLOCKLEN);
+
+  crypt_blocks(job, buf, buf, full);
+  if(full != len)
+  {
+    if(job->decrypt)
+    {
+      fprintf(stderr, "aescrypt: input is not a multiple of %d bytes\n", BLOCKLEN);
+      return (size_t)-1;
+    }
+    // pipeline.h guarantees PIPELINE_SLACK bytes of room for the padding
+    crypt_tail(job, buf + full, buf + full, len - full);
+    full += BLOCKLEN;
+  }
+  return full;
+}
+
+static int run_pipeline(struct job* job, const char* inpath, const char* outpath, size_t memory)
+{
+  int infd = STDIN_FILENO;
+  int outfd = STDOUT_FILENO;
+  int rc = 0;
+
+  if(strcmp(inpath, "-") != 0 && (infd = open(inpath, O_RDONLY)) < 0)
+  {
+    perror(inpath);
+    return 1;
+  }
+  if(strcmp(outpath, "-") != 0 && (outfd = open(outpath, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0)
+  {
+    perror(outpath);
+    if(infd != STDIN_FILENO)
+    {
+      close(infd);
+    }
+    return 1;
+  }
+
+  if(pipeline_run(infd, outfd, memory, pipeline_crypt, job) != 0)
+  {
+    fprintf(stderr, "aescrypt: pipeline failed\n");
+    rc = 1;
+  }
+
+  if(infd != STDIN_FILENO)
+  {
+    close(infd);
+  }
+  if(outfd != STDOUT_FILENO && close(outfd) != 0)
+  {
+    perror(outpath);
+    rc = 1;
+  }
+  return rc;
+}
+
+static size_t parse_size(const char* arg)
+{
+  char* end;
+  unsigned long n = strtoul(arg, &end, 10);
+
+  if(*end == 'k' || *end == 'K')
+  {
+    n *= 1024;
+    ++end;
+  }
+  else if(*end == 'm' || *end == 'M')
+  {
+    n *= 1024 * 1024;
+    ++end;
+  }
+  if(end == arg || *end != '\0' || n == 0)
+  {
+    usage();
+  }
+  return n;
+}
+
+static void* crypt_chunk(void* arg)
+{
+  struct chunk* c = arg;
+  AES128_packet_t packet;
+  size_t i;
+
+  if(c->job->mode == MODE_CBC)
+  {
+    packet.input = c->in;
+    packet.output = c->out;
+    packet.length = (uint32_t)c->len;
+    packet.iv = c->iv;
+    packet.key = &c->job->ctx;
+    AES128_CBC_decrypt_keyed_packets(&packet, 1);
+    return NULL;
+  }
+
+  for(i = 0; i < c->len; i += BLOCKLEN)
+  {
+    if(c->job->decrypt)
+    {
+      AES128_ECB_decrypt_keyed(c->in + i, &c->job->ctx, c->out + i);
+    }
+    else
+    {
+      AES128_ECB_encrypt_keyed(c->in + i, &c->job->ctx, c->out + i);
+    }
+  }
+  return NULL;
+}
+
+// crypt_blocks() for a window of the memory-mapped mode, split over job->threads threads
+// where the mode allows it.
+static void crypt_window(struct job* job, uint8_t* out, uint8_t* in, size_t len)
+{
+  static struct chunk chunks[MAX_THREADS];
+  size_t page = (size_t)sysconf(_SC_PAGESIZE);
+  size_t per, off;
+  int n, i;
+
+  if(job->threads <= 1 || job->use_afalg || (job->mode == MODE_CBC && !job->decrypt) || len <= page)
+  {
+    crypt_blocks(job, out, in, len);
+    return;
+  }
+
+  per = (len + (size_t)job->threads - 1) / (size_t)job->threads;
+  per = (per + page - 1) / page * page;
+  for(n = 0, off = 0; off < len; ++n, off += per)
+  {
+    chunks[n].job = job;
+    chunks[n].out = out + off;
+    chunks[n].in = in + off;
+    chunks[n].len = (len - off < per) ? len - off : per;
+    chunks[n].started = 0;
+    if(job->mode == MODE_CBC)
+    {
+      // Taken before any chunk is decrypted, in-place decryption overwrites them
+      memcpy(chunks[n].iv, (off == 0) ? job->iv : in + off - BLOCKLEN, BLOCKLEN);
+    }
+  }
+  if(job->mode == MODE_CBC)
+  {
+    memcpy(job->iv, in + len - BLOCKLEN, BLOCKLEN);
+  }
+
+  // The calling thread takes the first chunk, and any chunk no thread could be started for
+  for(i = 1; i < n; ++i)
+  {
+    chunks[i].started = pthread_create(&chunks[i].thread, NULL, crypt_chunk, &chunks[i]) == 0;
+  }
+  for(i = 0; i < n; ++i)
+  {
+    if(!chunks[i].started)
+    {
+      crypt_chunk(&chunks[i]);
+    }
+  }
+  for(i = 1; i < n; ++i)
+  {
+    if(chunks[i].started)
+    {
+      pthread_join(chunks[i].thread, NULL);
+    }
+  }
+}
+
+static int run_mmap(struct job* job, const char* inpath, const char* outpath)
+{
+  struct stat st;
+  int infd, outfd;
+  off_t inlen, outlen, off;
+  size_t n, outn, full;
+  uint8_t* inmap;
+  uint8_t* outmap;
+  int inplace = (outpath == NULL);
+  int rc = 0;
+
+  infd = open(inpath, inplace ? O_RDWR : O_RDONLY);
+  if(infd < 0 || fstat(infd, &st) != 0)
+  {
+    perror(inpath);
+    return 1;
+  }
+  inlen = st.st_size;
+  outlen = inlen;
+  if(inlen % BLOCKLEN)
+  {
+    if(job->decrypt)
+    {
+      fprintf(stderr, "aescrypt: input is not a multiple of %d bytes\n", BLOCKLEN);
+      close(infd);
+      return 1;
+    }
+    outlen += BLOCKLEN - (inlen % BLOCKLEN);
+  }
+
+  outfd = inplace ? infd : open(outpath, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if(outfd < 0 || ftruncate(outfd, outlen) != 0)
+  {
+    perror(inplace ? inpath : outpath);
+    close(infd);
+    return 1;
+  }
+
+  for(off = 0; off < inlen; off += MMAP_WINDOW)
+  {
+    n = (inlen - off < (off_t)MMAP_WINDOW) ? (size_t)(inlen - off) : MMAP_WINDOW;
+    outn = (off + (off_t)n == inlen) ? (size_t)(outlen - off) : n;
+
+    outmap = mmap(NULL, outn, PROT_READ | PROT_WRITE, MAP_SHARED, outfd, off);
+    if(outmap == MAP_FAILED)
+    {
+      perror("mmap");
+      rc = 1;
+      break;
+    }
+    madvise(outmap, outn, MADV_SEQUENTIAL);
+
+    if(inplace)
+    {
+      inmap = outmap;
+    }
+    else
+    {
+      inmap = mmap(NULL, n, PROT_READ, MAP_SHARED, infd, off);
+      if(inmap == MAP_FAILED)
+      {
+        perror("mmap");
+        munmap(outmap, outn);
+        rc = 1;
+        break;
+      }
+      madvise(inmap, n, MADV_SEQUENTIAL);
+    }
+
+    full = n - (n % BLOCKLEN);
+    crypt_window(job, outmap, inmap, full);
+    if(full != n)
+    {
+      crypt_tail(job, outmap + full, inmap + full, n - full);
+    }
+
+    if(!inplace)
+    {
+      munmap(inmap, n);
+    }
+    munmap(outmap, outn);
+  }
+
+  if(!inplace && close(outfd) != 0)
+  {
+    perror(outpath);
+    rc = 1;
+  }
+  close(infd);
+  return rc;
+}
+
+
+/*****************************************************************************/
+/* Public functions:                                                         */
+/*****************************************************************************/
+int main(int argc, char* argv[])
+{
+  struct job job;
+  int use_mmap = 0;
+  int use_pipeline = 0;
+  size_t memory = PIPELINE_MEMORY;
+  int have_key = 0;
+  int c, rc;
+
+  memset(&job, 0, sizeof(job));
+  job.mode = MODE_CBC;
+  job.threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+  job.threads = (job.threads < 1) ? 1 : (job.threads > MAX_THREADS) ? MAX_THREADS : job.threads;
+
+  while((c = getopt(argc, argv, "dm:k:i:KMt:pb:")) != -1)
+  {
+    switch(c)
+    {
+      case 'd':
+        job.decrypt = 1;
+        break;
+      case 'm':
+        if(strcmp(optarg, "ecb") == 0)
+        {
+          job.mode = MODE_ECB;
+        }
+        else if(strcmp(optarg, "cbc") == 0)
+        {
+          job.mode = MODE_CBC;
+        }
+        else
+        {
+          usage();
+        }
+        break;
+      case 'k':
+        if(parse_hex(job.key, optarg) != 0)
+        {
+          usage();
+        }
+        have_key = 1;
+        break;
+      case 'i':
+        if(parse_hex(job.iv, optarg) != 0)
+        {
+          usage();
+        }
+        break;
+      case 'K':
+        job.use_afalg = 1;
+        break;
+      case 'M':
+        use_mmap = 1;
+        break;
+      case 't':
+        job.threads = atoi(optarg);
+        if(job.threads < 1 || job.threads > MAX_THREADS)
+        {
+          usage();
+        }
+        break;
+      case 'p':
+        use_pipeline = 1;
+        break;
+      case 'b':
+        memory = parse_size(optarg);
+        break;
+      default:
+        usage();
+    }
+  }
+  if(!have_key || (use_mmap && use_pipeline) || optind >= argc || argc - optind > 2)
+  {
+    usage();
+  }
+
+  if(!use_mmap && optind + 1 >= argc)
+  {
+    usage();
+  }
+
+  job.keyp = job.key;
+  AES128_expand_key(&job.ctx, job.key);
+
+  if(job.use_afalg && afalg_open(&job.afalg, (job.mode == MODE_ECB) ? AFALG_ECB : AFALG_CBC, job.key) != 0)
+  {
+    perror("aescrypt: AF_ALG");
+    return 1;
+  }
+
+  if(use_mmap)
+  {
+    rc = run_mmap(&job, argv[optind], (optind + 1 < argc) ? argv[optind + 1] : NULL);
+  }
+  else if(use_pipeline)
+  {
+    rc = run_pipeline(&job, argv[optind], argv[optind + 1], memory);
+  }
+  else
+  {
+    rc = run_stream(&job, argv[optind], argv[optind + 1]);
+  }
+
+  if(job.use_afalg)
+  {
+    afalg_close(&job.afalg);
+  }
+  return rc;
+}
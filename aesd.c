@@ -0,0 +1,614 @@
+/*
+
+aesd - local AES128 encryption daemon.
+
+  aesd -s SOCKET -k KEYFILE
+  aesd -s SOCKET -x SCHEDULES
+  aesd -k KEYFILE -e SCHEDULES
+
+  -m METRICS  with -s, keep METRICS up to date with the library's counters
+
+Serves encrypt and decrypt requests over the Unix-domain socket SOCKET with the
+protocol in aesd.h. KEYFILE holds one key per line as 32 hex digits, the key_id of a
+request is the line number counting from 0. The keys are expanded once at startup
+and never leave the daemon.
+
+With -e the expanded keys are written to SCHEDULES (see keyfile.h) instead, and with
+-x the daemon maps such a file at startup rather than expanding the keys again.
+
+With -m the counters of aes.c (AES128_STATS) are written to METRICS in the Prometheus
+text format at most once a second, for the textfile collector of the node exporter.
+This needs aes.o and aesd built with -DAES128_STATS=1.
+
+Consecutive encryptions or decryptions found in one read from a connection are
+coalesced into a single call of AES128_CBC_{en,de}crypt_keyed_packets(). The daemon is single threaded and uses
+blocking writes for the responses, so it is meant for cooperating local clients
+that keep reading their responses (see aesd_client.c).
+
+*/
+
+
+/*****************************************************************************/
+/* Includes:                                                                 */
+/*****************************************************************************/
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <poll.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "aes.h"
+#include "aesd.h"
+#include "keyfile.h"
+
+
+/*****************************************************************************/
+/* Defines:                                                                  */
+/*****************************************************************************/
+#define MAX_CONNS 64
+
+// Requests processed in one library call.
+#define BATCH 64
+
+// Size of the per-connection input buffer and of the response buffer.
+#define BUFLEN (256 * 1024)
+
+// Room for descriptors in one read, more than one is a protocol error.
+#define MAX_PASSED_FDS 8
+
+
+/*****************************************************************************/
+/* Private variables:                                                        */
+/*****************************************************************************/
+struct conn
+{
+  int fd;
+  uint8_t* in;        // buffered, not yet processed request bytes
+  size_t inlen;
+  int passed_fd;      // last file descriptor received, for AESD_OP_ATTACH
+  uint8_t* shm;
+  size_t shmlen;
+};
+
+static const AES128_key_t* keys;
+static uint32_t nkeys;
+
+static struct conn conns[MAX_CONNS];
+static uint8_t out[BUFLEN];
+
+
+/*****************************************************************************/
+/* Private functions:                                                        */
+/*****************************************************************************/
+static void usage(void)
+{
+  fprintf(stderr, "usage: aesd -s SOCKET -k KEYFILE [-m METRICS] | -s SOCKET -x SCHEDULES [-m METRICS] | -k KEYFILE -e SCHEDULES\n");
+  exit(2);
+}
+
+#if AES128_STATS
+// Writes a snapshot of the counters to path through a temporary file, so that a collector
+// never reads half of one.
+static void write_metrics(const char* path)
+{
+  static char text[8192];
+  AES128_stats_t stats;
+  char* tmp;
+  FILE* f;
+  int n, rc;
+
+  AES128_stats_snapshot(&stats);
+  n = AES128_stats_prometheus(&stats, text, sizeof(text));
+  tmp = malloc(strlen(path) + 5);
+  if(tmp == NULL || n < 0 || (size_t)n >= sizeof(text))
+  {
+    free(tmp);
+    return;
+  }
+  sprintf(tmp, "%s.tmp", path);
+  f = fopen(tmp, "w");
+  if(f == NULL)
+  {
+    perror(tmp);
+    free(tmp);
+    return;
+  }
+  rc = (fwrite(text, 1, (size_t)n, f) == (size_t)n) ? 0 : -1;
+  if(fclose(f) != 0 || rc != 0 || rename(tmp, path) != 0)
+  {
+    unlink(tmp);
+  }
+  free(tmp);
+}
+#endif
+
+static int load_keys(const char* path)
+{
+  FILE* f = fopen(path, "r");
+  char line[128];
+  uint8_t* raw = NULL;
+  uint8_t* grown;
+  AES128_key_t* expanded;
+  unsigned int i, v;
+
+  if(f == NULL)
+  {
+    perror(path);
+    return -1;
+  }
+  while(fgets(line, sizeof(line), f) != NULL)
+  {
+    if(strspn(line, "0123456789abcdefABCDEF") != 32)
+    {
+      fprintf(stderr, "%s:%u: expected 32 hex digits\n", path, nkeys + 1);
+      fclose(f);
+      free(raw);
+      return -1;
+    }
+    grown = realloc(raw, (nkeys + 1) * 16);
+    if(grown == NULL)
+    {
+      fclose(f);
+      free(raw);
+      return -1;
+    }
+    raw = grown;
+    for(i = 0; i < 16; ++i)
+    {
+      sscanf(line + 2 * i, "%2x", &v);
+      raw[nkeys * 16 + i] = (uint8_t)v;
+    }
+    ++nkeys;
+  }
+  fclose(f);
+
+  // Keep the expanded keys on cache line boundaries
+  if(posix_memalign((void**)&expanded, AES128_KEY_ALIGN, (nkeys ? nkeys : 1) * sizeof(AES128_key_t)) != 0)
+  {
+    free(raw);
+    return -1;
+  }
+  AES128_expand_keys(expanded, raw, nkeys);
+  keys = expanded;
+
+  // The raw keys are not needed anymore
+  memset(raw, 0, nkeys * 16);
+  free(raw);
+  return 0;
+}
+
+static int map_schedules(const char* path)
+{
+  keyfile_t* kf = keyfile_open(path);
+
+  if(kf == NULL)
+  {
+    fprintf(stderr, "%s: not a key schedule file of this build\n", path);
+    return -1;
+  }
+  // Mapped for the lifetime of the daemon
+  keys = keyfile_keys(kf);
+  nkeys = keyfile_count(kf);
+  return 0;
+}
+
+static void close_conn(struct conn* c)
+{
+  close(c->fd);
+  if(c->passed_fd >= 0)
+  {
+    close(c->passed_fd);
+  }
+  if(c->shm != NULL)
+  {
+    munmap(c->shm, c->shmlen);
+  }
+  free(c->in);
+  memset(c, 0, sizeof(*c));
+  c->fd = -1;
+}
+
+static int write_all(int fd, const uint8_t* buf, size_t len)
+{
+  ssize_t n;
+
+  while(len > 0)
+  {
+    n = write(fd, buf, len);
+    if(n < 0 && errno == EINTR)
+    {
+      continue;
+    }
+    if(n < 0)
+    {
+      return -1;
+    }
+    buf += n;
+    len -= (size_t)n;
+  }
+  return 0;
+}
+
+// Reads what is available into the input buffer, keeping a passed file descriptor.
+// Returns -1 if the connection has to be dropped, also when a client passed more than
+// one descriptor at once: they are all closed rather than kept open in the daemon.
+static ssize_t read_conn(struct conn* c)
+{
+  char cbuf[CMSG_SPACE(MAX_PASSED_FDS * sizeof(int))];
+  struct msghdr msg;
+  struct cmsghdr* cmsg;
+  struct iovec iov;
+  int fds[MAX_PASSED_FDS];
+  size_t nfds = 0, k, i;
+  ssize_t n;
+
+  iov.iov_base = c->in + c->inlen;
+  iov.iov_len = BUFLEN - c->inlen;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = cbuf;
+  msg.msg_controllen = sizeof(cbuf);
+
+  n = recvmsg(c->fd, &msg, MSG_CMSG_CLOEXEC);
+  if(n <= 0)
+  {
+    return -1;
+  }
+  c->inlen += (size_t)n;
+
+  for(cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg))
+  {
+    if(cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+    {
+      k = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+      for(i = 0; i < k && nfds < MAX_PASSED_FDS; ++i)
+      {
+        memcpy(&fds[nfds++], CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+      }
+    }
+  }
+
+  // With MSG_CTRUNC the kernel has already closed the descriptors that did not fit
+  if(nfds > 1 || (msg.msg_flags & MSG_CTRUNC))
+  {
+    for(i = 0; i < nfds; ++i)
+    {
+      close(fds[i]);
+    }
+    return -1;
+  }
+  if(nfds == 1)
+  {
+    if(c->passed_fd >= 0)
+    {
+      close(c->passed_fd);
+    }
+    c->passed_fd = fds[0];
+  }
+  return n;
+}
+
+// Maps the passed segment. It must be at least length bytes and sealed against
+// shrinking, a client truncating a mapped segment would kill the daemon with SIGBUS.
+static int32_t attach(struct conn* c, uint32_t length)
+{
+  struct stat st;
+  void* map = MAP_FAILED;
+  int seals;
+
+  if(c->passed_fd < 0 || length == 0)
+  {
+    return AESD_EINVAL;
+  }
+  seals = fcntl(c->passed_fd, F_GET_SEALS);
+  if(fstat(c->passed_fd, &st) == 0 && (uint64_t)st.st_size >= length && seals >= 0 && (seals & F_SEAL_SHRINK))
+  {
+    map = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, c->passed_fd, 0);
+  }
+  close(c->passed_fd);
+  c->passed_fd = -1;
+  if(map == MAP_FAILED)
+  {
+    return AESD_EINVAL;
+  }
+  if(c->shm != NULL)
+  {
+    munmap(c->shm, c->shmlen);
+  }
+  c->shm = map;
+  c->shmlen = length;
+  return AESD_OK;
+}
+
+// Processes all complete requests in the input buffer, a batch at a time.
+// Returns -1 if the connection has to be dropped.
+static int process(struct conn* c)
+{
+  AES128_packet_t packets[BATCH];
+  AES128_packet_t* p;
+  struct aesd_request req;
+  struct aesd_response resp;
+  uint32_t nreq, npackets;
+  size_t pos = 0, outlen, payload;
+  uint8_t* data;
+  uint8_t op = 0;
+
+  for(;;)
+  {
+    nreq = npackets = 0;
+    outlen = 0;
+
+    while(nreq < BATCH && c->inlen - pos >= sizeof(req))
+    {
+      memcpy(&req, c->in + pos, sizeof(req));
+      payload = ((req.flags & AESD_FLAG_SHM) || req.op == AESD_OP_ATTACH) ? 0 : req.length;
+      if(payload > AESD_MAX_INLINE)
+      {
+        return -1;
+      }
+      if(c->inlen - pos < sizeof(req) + payload || outlen + sizeof(resp) + payload > BUFLEN)
+      {
+        break;
+      }
+      if(req.op == AESD_OP_ATTACH && nreq > 0)
+      {
+        // Finish the requests that use the current segment first
+        break;
+      }
+      if(npackets > 0 && req.op != op && (req.op == AESD_OP_ENCRYPT || req.op == AESD_OP_DECRYPT))
+      {
+        // One batch is all encryptions or all decryptions, so in-place requests on the
+        // same bytes still run in the order they were sent
+        break;
+      }
+
+      resp.id = req.id;
+      resp.status = AESD_OK;
+      resp.length = 0;
+      data = c->in + pos + sizeof(req);
+
+      if(req.op == AESD_OP_ATTACH)
+      {
+        resp.status = attach(c, req.length);
+      }
+      else if(req.op != AESD_OP_ENCRYPT && req.op != AESD_OP_DECRYPT)
+      {
+        resp.status = AESD_EINVAL;
+      }
+      else if(req.key_id >= nkeys)
+      {
+        resp.status = AESD_ENOKEY;
+      }
+      else if(req.length % 16)
+      {
+        resp.status = AESD_EINVAL;
+      }
+      else if((req.flags & AESD_FLAG_SHM) && c->shm == NULL)
+      {
+        resp.status = AESD_ENOSHM;
+      }
+      else if((req.flags & AESD_FLAG_SHM) && ((size_t)req.offset + req.length > c->shmlen))
+      {
+        resp.status = AESD_EINVAL;
+      }
+      else
+      {
+        op = req.op;
+        p = &packets[npackets++];
+        p->iv = c->in + pos + offsetof(struct aesd_request, iv);
+        p->key = &keys[req.key_id];
+        p->length = req.length;
+        if(req.flags & AESD_FLAG_SHM)
+        {
+          p->input = c->shm + req.offset;
+          p->output = c->shm + req.offset;
+        }
+        else
+        {
+          p->input = data;
+          p->output = out + outlen + sizeof(resp);
+          resp.length = req.length;
+        }
+      }
+
+      memcpy(out + outlen, &resp, sizeof(resp));
+      outlen += sizeof(resp) + resp.length;
+      pos += sizeof(req) + payload;
+      ++nreq;
+    }
+
+    if(nreq == 0)
+    {
+      break;
+    }
+
+    if(op == AESD_OP_ENCRYPT)
+    {
+      AES128_CBC_encrypt_keyed_packets(packets, npackets);
+    }
+    else
+    {
+      AES128_CBC_decrypt_keyed_packets(packets, npackets);
+    }
+
+    if(write_all(c->fd, out, outlen) != 0)
+    {
+      return -1;
+    }
+  }
+
+  memmove(c->in, c->in + pos, c->inlen - pos);
+  c->inlen -= pos;
+  return 0;
+}
+
+
+/*****************************************************************************/
+/* Public functions:                                                         */
+/*****************************************************************************/
+int main(int argc, char* argv[])
+{
+  struct pollfd pfds[MAX_CONNS + 1];
+  struct sockaddr_un addr;
+  const char* path = NULL;
+  const char* keyfile = NULL;
+  const char* schedules = NULL;
+  const char* export = NULL;
+  const char* metrics = NULL;
+#if AES128_STATS
+  time_t written = 0;
+#endif
+  int lfd, fd, c, i, n;
+
+  while((c = getopt(argc, argv, "s:k:x:e:m:")) != -1)
+  {
+    switch(c)
+    {
+      case 's':
+        path = optarg;
+        break;
+      case 'k':
+        keyfile = optarg;
+        break;
+      case 'x':
+        schedules = optarg;
+        break;
+      case 'e':
+        export = optarg;
+        break;
+      case 'm':
+        metrics = optarg;
+        break;
+      default:
+        usage();
+    }
+  }
+
+#if !AES128_STATS
+  if(metrics != NULL)
+  {
+    fprintf(stderr, "aesd: built without AES128_STATS, -m is not available\n");
+    return 2;
+  }
+#endif
+
+  if(export != NULL)
+  {
+    if(keyfile == NULL || path != NULL || schedules != NULL || metrics != NULL)
+    {
+      usage();
+    }
+    if(load_keys(keyfile) != 0 || keyfile_save(export, keys, nkeys) != 0)
+    {
+      perror(export);
+      return 1;
+    }
+    return 0;
+  }
+
+  if(path == NULL || (keyfile == NULL) == (schedules == NULL) || strlen(path) >= sizeof(addr.sun_path))
+  {
+    usage();
+  }
+  if((keyfile != NULL) ? load_keys(keyfile) : map_schedules(schedules))
+  {
+    return 1;
+  }
+
+  signal(SIGPIPE, SIG_IGN);
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path);
+  unlink(path);
+  lfd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if(lfd < 0 || bind(lfd, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(lfd, 16) != 0)
+  {
+    perror(path);
+    return 1;
+  }
+
+  for(i = 0; i < MAX_CONNS; ++i)
+  {
+    conns[i].fd = -1;
+  }
+
+  for(;;)
+  {
+    pfds[0].fd = lfd;
+    pfds[0].events = POLLIN;
+    for(i = 0; i < MAX_CONNS; ++i)
+    {
+      pfds[i + 1].fd = conns[i].fd;
+      pfds[i + 1].events = POLLIN;
+    }
+
+    n = poll(pfds, MAX_CONNS + 1, (metrics != NULL) ? 1000 : -1);
+    if(n < 0 && errno == EINTR)
+    {
+      continue;
+    }
+    if(n < 0)
+    {
+      perror("poll");
+      return 1;
+    }
+#if AES128_STATS
+    if(metrics != NULL && time(NULL) != written)
+    {
+      written = time(NULL);
+      write_metrics(metrics);
+    }
+#endif
+
+    if(pfds[0].revents & POLLIN)
+    {
+      fd = accept(lfd, NULL, NULL);
+      for(i = 0; fd >= 0 && i < MAX_CONNS && conns[i].fd >= 0; ++i)
+      {
+      }
+      if(fd >= 0 && i == MAX_CONNS)
+      {
+        close(fd);
+      }
+      else if(fd >= 0)
+      {
+        conns[i].in = malloc(BUFLEN);
+        if(conns[i].in == NULL)
+        {
+          close(fd);
+        }
+        else
+        {
+          conns[i].fd = fd;
+          conns[i].inlen = 0;
+          conns[i].passed_fd = -1;
+        }
+      }
+    }
+
+    for(i = 0; i < MAX_CONNS; ++i)
+    {
+      if(conns[i].fd >= 0 && pfds[i + 1].fd == conns[i].fd && (pfds[i + 1].revents & (POLLIN | POLLHUP | POLLERR)))
+      {
+        if(read_conn(&conns[i]) < 0 || process(&conns[i]) != 0)
+        {
+          close_conn(&conns[i]);
+        }
+      }
+    }
+  }
+}
@@ -0,0 +1,57 @@
+#ifndef _AESD_H_
+#define _AESD_H_
+
+#include <stdint.h>
+
+
+// Wire protocol of aesd, the local encryption daemon.
+//
+// A client connects to the daemon's Unix-domain stream socket and sends requests, each
+// an aesd_request header followed by length bytes of payload. Any number of requests may
+// be outstanding, responses come back in order as an aesd_response header followed by
+// the result. The daemon coalesces the consecutive requests of the same op that it
+// finds in one read into a single batch call of the library.
+//
+// Large payloads need not travel through the socket: the client attaches a shared
+// memory segment once (AESD_OP_ATTACH, with the file descriptor passed as SCM_RIGHTS),
+// then sets AESD_FLAG_SHM and gives offset/length in the segment. Such requests are
+// processed in-place in the segment and the response carries no payload. The segment
+// must be a memfd sealed with F_SEAL_SHRINK and at least as large as the attach says.
+//
+// All fields are in host byte order, client and daemon run on the same machine.
+// Data is AES128-CBC, length must be a multiple of 16.
+
+#define AESD_OP_ENCRYPT 1
+#define AESD_OP_DECRYPT 2
+#define AESD_OP_ATTACH  3   // length is the size of the segment, payload-less
+
+#define AESD_FLAG_SHM   1
+
+// Largest payload sent through the socket.
+#define AESD_MAX_INLINE (16 * 1024)
+
+#define AESD_OK         0
+#define AESD_EINVAL     -1  // malformed request, bad length or offset
+#define AESD_ENOKEY     -2  // unknown key_id
+#define AESD_ENOSHM     -3  // AESD_FLAG_SHM without an attached segment
+
+struct aesd_request
+{
+  uint32_t id;        // echoed in the response
+  uint8_t  op;
+  uint8_t  flags;
+  uint16_t key_id;    // index of the key in the daemon's key file
+  uint32_t length;
+  uint32_t offset;    // into the shared segment with AESD_FLAG_SHM
+  uint8_t  iv[16];
+};
+
+struct aesd_response
+{
+  uint32_t id;
+  int32_t  status;
+  uint32_t length;    // payload bytes following, 0 for errors and shared memory requests
+};
+
+
+#endif //_AESD_H_
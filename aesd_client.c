@@ -0,0 +1,354 @@
+/*
+
+aesd_client - load generator for aesd.
+
+  aesd_client -s SOCKET [-n COUNT] [-q DEPTH] [-l LENGTH] [-k KEY_ID] [-m]
+
+  -n COUNT   number of requests to send (default 100000)
+  -q DEPTH   requests kept outstanding on the connection (default 32)
+  -l LENGTH  payload bytes per request, a multiple of 16 (default 256)
+  -k KEY_ID  key to use (default 0)
+  -m         pass payloads through a shared memory segment instead of the socket
+
+First checks that a buffer comes back unchanged after an encrypt and decrypt round
+trip, then keeps DEPTH encrypt requests in flight until COUNT have been answered and
+reports requests and bytes per second.
+
+*/
+
+
+/*****************************************************************************/
+/* Includes:                                                                 */
+/*****************************************************************************/
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "aesd.h"
+
+
+/*****************************************************************************/
+/* Defines:                                                                  */
+/*****************************************************************************/
+// Request bytes that may be outstanding without shared memory.
+#define MAX_INFLIGHT (128 * 1024)
+
+
+/*****************************************************************************/
+/* Private variables:                                                        */
+/*****************************************************************************/
+static int fd;
+static uint32_t length = 256;
+static uint16_t key_id;
+static int use_shm;
+static uint8_t* shm;
+
+static uint8_t* rbuf;     // received, not yet parsed response bytes
+static size_t rlen;
+static size_t rcap;
+
+
+/*****************************************************************************/
+/* Private functions:                                                        */
+/*****************************************************************************/
+static void usage(void)
+{
+  fprintf(stderr, "usage: aesd_client -s SOCKET [-n COUNT] [-q DEPTH] [-l LENGTH] [-k KEY_ID] [-m]\n");
+  exit(2);
+}
+
+static void die(const char* what)
+{
+  perror(what);
+  exit(1);
+}
+
+static double now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// Sends one request, with the payload unless it is in shared memory slot.
+// passfd, if not negative, is passed along as SCM_RIGHTS.
+static void send_request(uint32_t id, uint8_t op, uint32_t slot, const uint8_t* payload, int passfd)
+{
+  char cbuf[CMSG_SPACE(sizeof(int))];
+  struct aesd_request req;
+  struct msghdr msg;
+  struct cmsghdr* cmsg;
+  struct iovec iov[2];
+  ssize_t n;
+  size_t total;
+
+  memset(&req, 0, sizeof(req));
+  req.id = id;
+  req.op = op;
+  req.key_id = key_id;
+  req.length = length;
+  if(use_shm && op != AESD_OP_ATTACH)
+  {
+    req.flags = AESD_FLAG_SHM;
+    req.offset = slot * length;
+  }
+
+  memset(&msg, 0, sizeof(msg));
+  iov[0].iov_base = &req;
+  iov[0].iov_len = sizeof(req);
+  iov[1].iov_base = (void*)payload;
+  iov[1].iov_len = (payload != NULL) ? length : 0;
+  msg.msg_iov = iov;
+  msg.msg_iovlen = 2;
+  total = iov[0].iov_len + iov[1].iov_len;
+  if(passfd >= 0)
+  {
+    msg.msg_control = cbuf;
+    msg.msg_controllen = sizeof(cbuf);
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &passfd, sizeof(int));
+  }
+
+  // Requests are small next to the socket buffer, a short write only happens under pressure
+  while(total > 0)
+  {
+    n = sendmsg(fd, &msg, 0);
+    if(n < 0 && errno == EINTR)
+    {
+      continue;
+    }
+    if(n < 0)
+    {
+      die("send");
+    }
+    total -= (size_t)n;
+    msg.msg_control = NULL;
+    msg.msg_controllen = 0;
+    while(n > 0 && msg.msg_iovlen > 0)
+    {
+      if((size_t)n >= msg.msg_iov[0].iov_len)
+      {
+        n -= (ssize_t)msg.msg_iov[0].iov_len;
+        ++msg.msg_iov;
+        --msg.msg_iovlen;
+      }
+      else
+      {
+        msg.msg_iov[0].iov_base = (uint8_t*)msg.msg_iov[0].iov_base + n;
+        msg.msg_iov[0].iov_len -= (size_t)n;
+        n = 0;
+      }
+    }
+  }
+}
+
+// Returns the next complete response from rbuf, or NULL. The payload follows the header.
+static struct aesd_response* next_response(size_t* used)
+{
+  struct aesd_response* resp = (struct aesd_response*)rbuf;
+
+  if(rlen < sizeof(*resp) || rlen < sizeof(*resp) + resp->length)
+  {
+    return NULL;
+  }
+  *used = sizeof(*resp) + resp->length;
+  return resp;
+}
+
+static void consume(size_t used)
+{
+  memmove(rbuf, rbuf + used, rlen - used);
+  rlen -= used;
+}
+
+static void receive(void)
+{
+  ssize_t n = read(fd, rbuf + rlen, rcap - rlen);
+  if(n <= 0)
+  {
+    if(n < 0 && errno == EINTR)
+    {
+      return;
+    }
+    fprintf(stderr, "aesd_client: connection closed\n");
+    exit(1);
+  }
+  rlen += (size_t)n;
+}
+
+// Sends a request and waits for its response, copying the result to result.
+static int32_t roundtrip(uint8_t op, const uint8_t* payload, uint8_t* result, int passfd)
+{
+  struct aesd_response* resp;
+  size_t used;
+  int32_t status;
+
+  if(use_shm && op != AESD_OP_ATTACH)
+  {
+    memcpy(shm, payload, length);
+    payload = NULL;
+  }
+  send_request(0, op, 0, (op == AESD_OP_ATTACH) ? NULL : payload, passfd);
+  while((resp = next_response(&used)) == NULL)
+  {
+    receive();
+  }
+  status = resp->status;
+  if(result != NULL)
+  {
+    memcpy(result, use_shm ? shm : (uint8_t*)(resp + 1), length);
+  }
+  consume(used);
+  return status;
+}
+
+
+/*****************************************************************************/
+/* Public functions:                                                         */
+/*****************************************************************************/
+int main(int argc, char* argv[])
+{
+  struct sockaddr_un addr;
+  struct pollfd pfd;
+  struct aesd_response* resp;
+  const char* path = NULL;
+  uint32_t count = 100000, depth = 32;
+  uint32_t sent = 0, done = 0, errors = 0;
+  uint8_t* plain;
+  uint8_t* check;
+  size_t used;
+  double t0, t1;
+  int c, shmfd = -1;
+  uint32_t i;
+
+  while((c = getopt(argc, argv, "s:n:q:l:k:m")) != -1)
+  {
+    switch(c)
+    {
+      case 's': path = optarg; break;
+      case 'n': count = (uint32_t)strtoul(optarg, NULL, 10); break;
+      case 'q': depth = (uint32_t)strtoul(optarg, NULL, 10); break;
+      case 'l': length = (uint32_t)strtoul(optarg, NULL, 10); break;
+      case 'k': key_id = (uint16_t)strtoul(optarg, NULL, 10); break;
+      case 'm': use_shm = 1; break;
+      default: usage();
+    }
+  }
+  if(path == NULL || strlen(path) >= sizeof(addr.sun_path) || depth == 0 || length == 0 || length % 16
+    || (!use_shm && length > AESD_MAX_INLINE))
+  {
+    usage();
+  }
+  if(!use_shm && (size_t)depth * (sizeof(struct aesd_request) + length) > MAX_INFLIGHT)
+  {
+    // Requests are sent with blocking writes while the daemon blocks writing responses,
+    // so everything in flight has to fit into the socket buffers.
+    fprintf(stderr, "aesd_client: more than %d bytes in flight, lower -q or use -m\n", MAX_INFLIGHT);
+    return 2;
+  }
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path);
+  fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if(fd < 0 || connect(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0)
+  {
+    die(path);
+  }
+
+  rcap = depth * (sizeof(struct aesd_response) + length) + 65536;
+  rbuf = malloc(rcap);
+  plain = malloc(length);
+  check = malloc(length);
+  if(rbuf == NULL || plain == NULL || check == NULL)
+  {
+    die("malloc");
+  }
+  for(i = 0; i < length; ++i)
+  {
+    plain[i] = (uint8_t)i;
+  }
+
+  if(use_shm)
+  {
+    // One slot of length bytes per outstanding request
+    shmfd = memfd_create("aesd_client", MFD_ALLOW_SEALING);
+    if(shmfd < 0 || ftruncate(shmfd, (off_t)depth * length) != 0 || fcntl(shmfd, F_ADD_SEALS, F_SEAL_SHRINK) != 0)
+    {
+      die("memfd");
+    }
+    shm = mmap(NULL, (size_t)depth * length, PROT_READ | PROT_WRITE, MAP_SHARED, shmfd, 0);
+    if(shm == MAP_FAILED)
+    {
+      die("mmap");
+    }
+    length = depth * length;
+    if(roundtrip(AESD_OP_ATTACH, NULL, NULL, shmfd) != AESD_OK)
+    {
+      fprintf(stderr, "aesd_client: attaching shared memory failed\n");
+      return 1;
+    }
+    length /= depth;
+    close(shmfd);
+  }
+
+  if(roundtrip(AESD_OP_ENCRYPT, plain, check, -1) != AESD_OK
+    || roundtrip(AESD_OP_DECRYPT, check, check, -1) != AESD_OK
+    || memcmp(plain, check, length) != 0)
+  {
+    fprintf(stderr, "aesd_client: round trip check failed\n");
+    return 1;
+  }
+  printf("round trip: SUCCESS!\n");
+
+  t0 = now();
+  while(done < count)
+  {
+    // Top up the window of outstanding requests, then wait for responses
+    while(sent < count && sent - done < depth)
+    {
+      send_request(sent, AESD_OP_ENCRYPT, sent % depth, use_shm ? NULL : plain, -1);
+      ++sent;
+    }
+
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    if(poll(&pfd, 1, -1) < 0 && errno != EINTR)
+    {
+      die("poll");
+    }
+    if(pfd.revents)
+    {
+      receive();
+    }
+    while((resp = next_response(&used)) != NULL)
+    {
+      if(resp->status != AESD_OK)
+      {
+        ++errors;
+      }
+      consume(used);
+      ++done;
+    }
+  }
+  t1 = now();
+
+  printf("%u requests of %u bytes, depth %u%s: %.0f requests/s, %.1f MB/s, %u errors\n",
+         count, length, depth, use_shm ? ", shared memory" : "",
+         count / (t1 - t0), (double)count * length / (t1 - t0) / 1e6, errors);
+  return errors ? 1 : 0;
+}
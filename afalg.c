@@ -0,0 +1,269 @@
+/*
+
+AES128 through the Linux kernel crypto API, see afalg.h.
+
+Each call is split into chunks of AFALG_CHUNK bytes. For every chunk the operation
+and IV are sent as control messages, the input pages are vmsplice'd into a pipe and
+spliced on into the operation socket, and the result is read back into the output.
+
+*/
+
+
+/*****************************************************************************/
+/* Includes:                                                                 */
+/*****************************************************************************/
+#define _GNU_SOURCE
+
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <linux/if_alg.h>
+#include "afalg.h"
+
+
+/*****************************************************************************/
+/* Defines:                                                                  */
+/*****************************************************************************/
+#define BLOCKLEN 16
+
+#ifndef SOL_ALG
+  #define SOL_ALG 279
+#endif
+
+// Bytes handed to the kernel per operation. The kernel limits how much data a single
+// operation may queue, and a default pipe holds 64 KiB.
+#ifndef AFALG_CHUNK
+  #define AFALG_CHUNK (64 * 1024)
+#endif
+
+
+/*****************************************************************************/
+/* Private functions:                                                        */
+/*****************************************************************************/
+
+// Sends the operation and IV for the next request, the data follows (MSG_MORE).
+// If data is not 0 it is sent along in the same message, copying it into the socket.
+static int send_op(afalg_t* ctx, int decrypt, const uint8_t* iv, const uint8_t* data, size_t len)
+{
+  char cbuf[CMSG_SPACE(sizeof(uint32_t)) + CMSG_SPACE(sizeof(struct af_alg_iv) + BLOCKLEN)];
+  struct msghdr msg;
+  struct cmsghdr* cmsg;
+  struct af_alg_iv* alg_iv;
+  struct iovec iov;
+  ssize_t sent;
+
+  memset(cbuf, 0, sizeof(cbuf));
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_control = cbuf;
+  msg.msg_controllen = (ctx->mode == AFALG_ECB) ? CMSG_SPACE(sizeof(uint32_t)) : sizeof(cbuf);
+
+  cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_ALG;
+  cmsg->cmsg_type = ALG_SET_OP;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(uint32_t));
+  *(uint32_t*)CMSG_DATA(cmsg) = decrypt ? ALG_OP_DECRYPT : ALG_OP_ENCRYPT;
+
+  if(ctx->mode != AFALG_ECB)
+  {
+    cmsg = CMSG_NXTHDR(&msg, cmsg);
+    cmsg->cmsg_level = SOL_ALG;
+    cmsg->cmsg_type = ALG_SET_IV;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(struct af_alg_iv) + BLOCKLEN);
+    alg_iv = (struct af_alg_iv*)CMSG_DATA(cmsg);
+    alg_iv->ivlen = BLOCKLEN;
+    memcpy(alg_iv->iv, iv, BLOCKLEN);
+  }
+
+  if(data != 0)
+  {
+    iov.iov_base = (void*)data;
+    iov.iov_len = len;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+  }
+
+  // Without MSG_MORE the request is closed by this send, so the rest of a short send
+  // could not follow it - fail instead of handing an incomplete request to the kernel
+  sent = sendmsg(ctx->opfd, &msg, (data != 0) ? 0 : MSG_MORE);
+  if(sent >= 0 && (size_t)sent != ((data != 0) ? len : 0))
+  {
+    errno = EIO;
+    return -1;
+  }
+  return (sent < 0) ? -1 : 0;
+}
+
+// Moves len bytes of user memory into the operation socket without copying them.
+static int splice_data(afalg_t* ctx, const uint8_t* data, size_t len)
+{
+  struct iovec iov;
+  ssize_t in, out;
+
+  while(len > 0)
+  {
+    iov.iov_base = (void*)data;
+    iov.iov_len = len;
+    in = vmsplice(ctx->pipefd[1], &iov, 1, 0);
+    if(in < 0)
+    {
+      return -1;
+    }
+    data += in;
+    len -= (size_t)in;
+
+    while(in > 0)
+    {
+      out = splice(ctx->pipefd[0], NULL, ctx->opfd, NULL, (size_t)in, (len > 0) ? SPLICE_F_MORE : 0);
+      if(out < 0)
+      {
+        return -1;
+      }
+      in -= out;
+    }
+  }
+  return 0;
+}
+
+static int read_all(int fd, uint8_t* buf, size_t len)
+{
+  ssize_t n;
+
+  while(len > 0)
+  {
+    n = read(fd, buf, len);
+    if(n < 0 && errno == EINTR)
+    {
+      continue;
+    }
+    if(n <= 0)
+    {
+      return -1;
+    }
+    buf += n;
+    len -= (size_t)n;
+  }
+  return 0;
+}
+
+// Adds blocks to the big-endian 128 bit counter, the way the kernel's ctr(aes) advances it.
+static void ctr_add(uint8_t* ctr, size_t blocks)
+{
+  int i;
+  uint32_t sum;
+
+  for(i = BLOCKLEN - 1; i >= 0 && blocks > 0; --i)
+  {
+    sum = ctr[i] + (uint32_t)(blocks & 0xff);
+    ctr[i] = (uint8_t)sum;
+    blocks = (blocks >> 8) + (sum >> 8);
+  }
+}
+
+
+/*****************************************************************************/
+/* Public functions:                                                         */
+/*****************************************************************************/
+int afalg_open(afalg_t* ctx, int mode, const uint8_t* key)
+{
+  static const char* const names[] = { "ecb(aes)", "cbc(aes)", "ctr(aes)" };
+  struct sockaddr_alg sa;
+
+  memset(ctx, 0, sizeof(*ctx));
+  ctx->tfmfd = ctx->opfd = ctx->pipefd[0] = ctx->pipefd[1] = -1;
+  ctx->mode = mode;
+  if(mode < AFALG_ECB || mode > AFALG_CTR)
+  {
+    errno = EINVAL;
+    return -1;
+  }
+
+  memset(&sa, 0, sizeof(sa));
+  sa.salg_family = AF_ALG;
+  strcpy((char*)sa.salg_type, "skcipher");
+  strcpy((char*)sa.salg_name, names[mode]);
+
+  if((ctx->tfmfd = socket(AF_ALG, SOCK_SEQPACKET, 0)) < 0
+    || bind(ctx->tfmfd, (struct sockaddr*)&sa, sizeof(sa)) != 0
+    || setsockopt(ctx->tfmfd, SOL_ALG, ALG_SET_KEY, key, BLOCKLEN) != 0
+    || (ctx->opfd = accept(ctx->tfmfd, NULL, 0)) < 0
+    || pipe(ctx->pipefd) != 0)
+  {
+    afalg_close(ctx);
+    return -1;
+  }
+  return 0;
+}
+
+int afalg_crypt(afalg_t* ctx, int decrypt, uint8_t* output, const uint8_t* input, size_t length, uint8_t* iv)
+{
+  uint8_t next[BLOCKLEN];
+  size_t n;
+  int rc;
+
+  if(length % BLOCKLEN)
+  {
+    errno = EINVAL;
+    return -1;
+  }
+
+  for(; length > 0; length -= n, input += n, output += n)
+  {
+    n = (length < AFALG_CHUNK) ? length : AFALG_CHUNK;
+
+    if(ctx->mode == AFALG_CBC && decrypt)
+    {
+      // The next IV is the last ciphertext block, output may overwrite it
+      memcpy(next, input + n - BLOCKLEN, BLOCKLEN);
+    }
+
+    if(output == input)
+    {
+      // The spliced pages are read while the result is written, so in-place requests are copied instead
+      rc = send_op(ctx, decrypt, iv, input, n);
+    }
+    else
+    {
+      rc = send_op(ctx, decrypt, iv, 0, 0);
+      if(rc == 0)
+      {
+        rc = splice_data(ctx, input, n);
+      }
+    }
+    if(rc != 0 || read_all(ctx->opfd, output, n) != 0)
+    {
+      return -1;
+    }
+
+    if(ctx->mode == AFALG_CBC)
+    {
+      memcpy(iv, decrypt ? next : output + n - BLOCKLEN, BLOCKLEN);
+    }
+    else if(ctx->mode == AFALG_CTR)
+    {
+      ctr_add(iv, n / BLOCKLEN);
+    }
+  }
+  return 0;
+}
+
+void afalg_close(afalg_t* ctx)
+{
+  if(ctx->pipefd[0] >= 0)
+  {
+    close(ctx->pipefd[0]);
+    close(ctx->pipefd[1]);
+  }
+  if(ctx->opfd >= 0)
+  {
+    close(ctx->opfd);
+  }
+  if(ctx->tfmfd >= 0)
+  {
+    close(ctx->tfmfd);
+  }
+  ctx->tfmfd = ctx->opfd = ctx->pipefd[0] = ctx->pipefd[1] = -1;
+}
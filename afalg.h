@@ -0,0 +1,38 @@
+#ifndef _AFALG_H_
+#define _AFALG_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+
+// AES128 through the Linux kernel crypto API (AF_ALG sockets).
+//
+// Routes ECB, CBC and CTR to whatever implementation the kernel picks for "ecb(aes)",
+// "cbc(aes)" and "ctr(aes)" - possibly a hardware driver - so it can be compared with
+// the code in aes.c. The input is handed to the kernel with vmsplice/splice instead of
+// being copied through the socket.
+
+enum { AFALG_ECB, AFALG_CBC, AFALG_CTR };
+
+typedef struct
+{
+  int tfmfd;       // transformation socket, holds the key
+  int opfd;        // operation socket
+  int pipefd[2];   // pipe for splicing the input into opfd
+  int mode;
+} afalg_t;
+
+// Opens a kernel cipher for mode with the 16 byte key. Returns 0, or -1 with errno set
+// (e.g. EAFNOSUPPORT when the kernel has no AF_ALG support).
+int afalg_open(afalg_t* ctx, int mode, const uint8_t* key);
+
+// Encrypts or decrypts length bytes, a multiple of 16. output may equal input.
+// For CBC and CTR iv is updated to the chaining value or counter of the next call, for ECB
+// it may be 0. CTR encrypts and decrypts alike.
+// Returns 0 or -1 with errno set.
+int afalg_crypt(afalg_t* ctx, int decrypt, uint8_t* output, const uint8_t* input, size_t length, uint8_t* iv);
+
+void afalg_close(afalg_t* ctx);
+
+
+#endif //_AFALG_H_
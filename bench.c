@@ -0,0 +1,1035 @@
+/*
+
+bench - benchmark suite for `make bench`.
+
+  bench [-s MAXBYTES] [-n TRIALS] [-p] [-c CSV] [-j JSON] [-B BASELINE | -b BASELINE [-t PERCENT]]
+
+  -s MAXBYTES  largest message size, sizes run from 16 bytes up in steps of 4x (default 256K)
+  -n TRIALS    timed trials per measurement, after one warmup run (default 7)
+  -p           also read hardware performance counters (perf_event_open)
+  -c CSV       also write the results as CSV to this file
+  -j JSON      also write the results as JSON to this file
+  -B BASELINE  write the throughput of every trial to BASELINE, for -b
+  -b BASELINE  compare with BASELINE and exit with 3 if anything got slower
+  -t PERCENT   slowdown tolerated by -b (default 5)
+
+Measures every mode of aes.c, and of the kernel through AF_ALG when the kernel offers
+it, for each message size. All of them use a key expanded once before the run, ECB
+through the keyed calls; the cost of a new key is left to the key agility section. CTR, which aes.c lacks, is measured as counter blocks through
+the keyed ECB call against the kernel's ctr(aes). A trial processes at least MIN_TRIAL_BYTES, repeating small
+messages, and is timed with rdtsc (x86 hosts only) and the monotonic clock. Reported
+are the medians of all trials and the spread, the interquartile range relative to the
+median.
+
+With -p the instructions, cycles, L1 data cache read misses and branch misses of the
+trials are counted as well, and reported as instructions per byte, instructions per
+cycle and misses per 16 byte block. Counters the kernel does not offer, as is common in
+containers and VMs, are shown as "-" and the rest of the run is unaffected.
+
+Built with -DAES128_STAGE_TIMING=1 (`make stages`) the run is followed by the time spent
+in each stage of the cipher over the whole matrix, see AES128_stage_report().
+
+With -b every engine, mode and size found in the baseline is compared with this run.
+A case has regressed when its median throughput dropped by more than the threshold and
+a one-sided Mann-Whitney U test over the per-trial throughputs of both runs says the
+drop is not noise (p < REGRESSION_ALPHA). Use the same -n for both runs, the test can
+only reach significance with enough trials on either side.
+
+Then the key setup functions are timed per key, and the latency of the first block
+decrypted after the caches were flushed (cold), after AES128_preload() (preloaded) and
+right after another block (warm).
+
+Key agility is measured for a workload that changes keys with almost every message:
+every engine sets up a new key, for decryption the schedule that is read backwards,
+and processes 0, 1, 4, 16 and 64 blocks with it. The last column is the message size
+at which processing the data costs as much as the key setup, above it the setup is
+paid back. For AF_ALG the setup is opening a kernel handle with the key.
+
+*/
+
+
+/*****************************************************************************/
+/* Includes:                                                                 */
+/*****************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include "aes.h"
+#include "afalg.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+  #include <x86intrin.h>
+  #define HAVE_CYCLES 1
+#else
+  #define HAVE_CYCLES 0
+#endif
+
+
+/*****************************************************************************/
+/* Defines:                                                                  */
+/*****************************************************************************/
+#define MAX_TRIALS 101
+
+// Smaller messages are repeated until a trial covers this many bytes.
+#define MIN_TRIAL_BYTES (16 * 1024)
+
+// Keys set up per trial of the key setup benchmarks.
+#define SETUP_KEYS 256
+
+// Keys, each with a message, per trial of the key agility benchmark.
+#define AGILITY_KEYS 16
+
+// Largest message of the key agility benchmark, the buffers are at least this long.
+#define AGILITY_MAX_BYTES (64 * 16)
+
+// Memory walked through to push the tables out of all cache levels.
+#define EVICT_BYTES (64 * 1024 * 1024)
+
+// Measurements kept for -B and -b: cases times sizes.
+#define MAX_SAMPLE_SETS 512
+
+// Significance level of the regression test of -b.
+#define REGRESSION_ALPHA 0.01
+
+
+/*****************************************************************************/
+/* Private variables:                                                        */
+/*****************************************************************************/
+static const uint8_t key[16] = { 0x2b, 0x7e, 0x15, 0x16, 0x28, 0xae, 0xd2, 0xa6, 0xab, 0xf7, 0x15, 0x88, 0x09, 0xcf, 0x4f, 0x3c };
+static const uint8_t iv[16]  = { 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f };
+
+// One measured operation: processes len bytes from in to out.
+struct bench_case
+{
+  const char* engine;
+  const char* mode;
+  int (*fn)(uint8_t* out, const uint8_t* in, size_t len);
+};
+
+// Key setup from the raw key followed by processing len bytes, 0 for the setup alone.
+struct agility_case
+{
+  const char* engine;
+  const char* mode;
+  int (*fn)(const uint8_t* raw, uint8_t* out, const uint8_t* in, size_t len);
+};
+
+// Hardware counters read with -p.
+enum { CTR_INSTRUCTIONS, CTR_CYCLES, CTR_L1D_MISSES, CTR_BRANCH_MISSES, COUNTERS };
+
+struct result
+{
+  double cycles;    // median cycles per byte, 0 without rdtsc
+  double mbs;       // MB/s from the median wall clock time
+  double spread;    // interquartile range of the wall clock times / median, in %
+  double counts[COUNTERS];   // per byte over all trials, -1 if not counted
+  double trial_mbs[MAX_TRIALS];   // MB/s of every trial
+};
+
+// The per-trial throughputs of one engine, mode and size, of this run or of a baseline.
+struct sample_set
+{
+  char engine[16];
+  char mode[16];
+  size_t size;
+  int n;
+  double mbs[MAX_TRIALS];
+};
+
+static int counter_fd[COUNTERS] = { -1, -1, -1, -1 };
+
+static AES128_key_t ctx;
+static AES128_dkey_t dctx;
+static afalg_t kernel_ecb;
+static afalg_t kernel_cbc;
+static afalg_t kernel_ctr;
+
+static uint8_t* evict_buf;
+
+static struct sample_set samples[MAX_SAMPLE_SETS];
+static int sample_count;
+
+
+/*****************************************************************************/
+/* Private functions:                                                        */
+/*****************************************************************************/
+static void usage(void)
+{
+  fprintf(stderr, "usage: bench [-s MAXBYTES] [-n TRIALS] [-p] [-c CSV] [-j JSON] [-B BASELINE | -b BASELINE [-t PERCENT]]\n");
+  exit(2);
+}
+
+static uint64_t cycles(void)
+{
+#if HAVE_CYCLES
+  return __rdtsc();
+#else
+  return 0;
+#endif
+}
+
+static uint64_t nanoseconds(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+static int compare(const void* a, const void* b)
+{
+  uint64_t x = *(const uint64_t*)a;
+  uint64_t y = *(const uint64_t*)b;
+  return (x > y) - (x < y);
+}
+
+// Sorts t and returns its median.
+static uint64_t median(uint64_t* t, int n)
+{
+  qsort(t, (size_t)n, sizeof(*t), compare);
+  return t[n / 2];
+}
+
+static int ecb_encrypt(uint8_t* out, const uint8_t* in, size_t len)
+{
+  size_t i;
+  for(i = 0; i < len; i += 16)
+  {
+    AES128_ECB_encrypt_keyed(in + i, &ctx, out + i);
+  }
+  return 0;
+}
+
+static int ecb_decrypt(uint8_t* out, const uint8_t* in, size_t len)
+{
+  size_t i;
+  for(i = 0; i < len; i += 16)
+  {
+    AES128_ECB_decrypt_keyed(in + i, &ctx, out + i);
+  }
+  return 0;
+}
+
+static int ecb_decrypt_dkey(uint8_t* out, const uint8_t* in, size_t len)
+{
+  size_t i;
+  for(i = 0; i < len; i += 16)
+  {
+    AES128_ECB_decrypt_dkey(in + i, &dctx, out + i);
+  }
+  return 0;
+}
+
+static int cbc_encrypt(uint8_t* out, const uint8_t* in, size_t len)
+{
+  AES128_CBC_encrypt_buffer(out, (uint8_t*)in, (uint32_t)len, key, iv);
+  return 0;
+}
+
+static int cbc_decrypt(uint8_t* out, const uint8_t* in, size_t len)
+{
+  AES128_CBC_decrypt_buffer(out, (uint8_t*)in, (uint32_t)len, key, iv);
+  return 0;
+}
+
+static int cbc_encrypt_keyed(uint8_t* out, const uint8_t* in, size_t len)
+{
+  AES128_packet_t packet = { in, out, (uint32_t)len, iv, &ctx };
+  AES128_CBC_encrypt_keyed_packets(&packet, 1);
+  return 0;
+}
+
+// aes.c has no CTR mode, this is the counter mode a caller would build on the keyed ECB
+// call, to compare with the kernel's ctr(aes).
+static int ctr_encrypt(uint8_t* out, const uint8_t* in, size_t len)
+{
+  uint8_t counter[16], stream[16];
+  size_t i;
+  int j;
+
+  memcpy(counter, iv, sizeof(counter));
+  for(i = 0; i < len; i += 16)
+  {
+    AES128_ECB_encrypt_keyed(counter, &ctx, stream);
+    for(j = 0; j < 16; ++j)
+    {
+      out[i + j] = in[i + j] ^ stream[j];
+    }
+    for(j = 15; j >= 0 && ++counter[j] == 0; --j)
+    {
+    }
+  }
+  return 0;
+}
+
+static int kernel_ecb_encrypt(uint8_t* out, const uint8_t* in, size_t len)
+{
+  return afalg_crypt(&kernel_ecb, 0, out, in, len, 0);
+}
+
+static int kernel_cbc_encrypt(uint8_t* out, const uint8_t* in, size_t len)
+{
+  uint8_t chain[16];
+  memcpy(chain, iv, sizeof(chain));
+  return afalg_crypt(&kernel_cbc, 0, out, in, len, chain);
+}
+
+static int kernel_cbc_decrypt(uint8_t* out, const uint8_t* in, size_t len)
+{
+  uint8_t chain[16];
+  memcpy(chain, iv, sizeof(chain));
+  return afalg_crypt(&kernel_cbc, 1, out, in, len, chain);
+}
+
+static int kernel_ctr_encrypt(uint8_t* out, const uint8_t* in, size_t len)
+{
+  uint8_t counter[16];
+  memcpy(counter, iv, sizeof(counter));
+  return afalg_crypt(&kernel_ctr, 0, out, in, len, counter);
+}
+
+static int agile_cbc_encrypt(const uint8_t* raw, uint8_t* out, const uint8_t* in, size_t len)
+{
+  AES128_key_t k;
+  AES128_packet_t packet = { in, out, (uint32_t)len, iv, &k };
+
+  AES128_expand_key(&k, raw);
+  AES128_CBC_encrypt_keyed_packets(&packet, 1);
+  return 0;
+}
+
+static int agile_cbc_decrypt(const uint8_t* raw, uint8_t* out, const uint8_t* in, size_t len)
+{
+  AES128_key_t k;
+  AES128_packet_t packet = { in, out, (uint32_t)len, iv, &k };
+
+  AES128_expand_key(&k, raw);
+  AES128_CBC_decrypt_keyed_packets(&packet, 1);
+  return 0;
+}
+
+static int agile_ecb_decrypt_dkey(const uint8_t* raw, uint8_t* out, const uint8_t* in, size_t len)
+{
+  AES128_dkey_t k;
+  size_t i;
+
+  AES128_expand_dkey(&k, raw);
+  for(i = 0; i < len; i += 16)
+  {
+    AES128_ECB_decrypt_dkey(in + i, &k, out + i);
+  }
+  return 0;
+}
+
+static int agile_kernel_cbc_encrypt(const uint8_t* raw, uint8_t* out, const uint8_t* in, size_t len)
+{
+  afalg_t k;
+  uint8_t chain[16];
+  int rc = 0;
+
+  if(afalg_open(&k, AFALG_CBC, raw) != 0)
+  {
+    return -1;
+  }
+  memcpy(chain, iv, sizeof(chain));
+  if(len != 0)
+  {
+    rc = afalg_crypt(&k, 0, out, in, len, chain);
+  }
+  afalg_close(&k);
+  return rc;
+}
+
+// Opens the counters the kernel offers for this thread. Returns how many could be opened.
+static int open_counters(void)
+{
+  static const struct { uint32_t type; uint64_t config; } events[COUNTERS] =
+  {
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+    { PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16) },
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+  };
+  struct perf_event_attr attr;
+  int i, n = 0;
+
+  for(i = 0; i < COUNTERS; ++i)
+  {
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = events[i].type;
+    attr.config = events[i].config;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    counter_fd[i] = (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    n += (counter_fd[i] >= 0);
+  }
+  return n;
+}
+
+static void start_counters(void)
+{
+  int i;
+  for(i = 0; i < COUNTERS; ++i)
+  {
+    if(counter_fd[i] >= 0)
+    {
+      ioctl(counter_fd[i], PERF_EVENT_IOC_RESET, 0);
+      ioctl(counter_fd[i], PERF_EVENT_IOC_ENABLE, 0);
+    }
+  }
+}
+
+// Stops the counters and adds their values to sum.
+static void stop_counters(uint64_t* sum)
+{
+  uint64_t v;
+  int i;
+
+  for(i = 0; i < COUNTERS; ++i)
+  {
+    if(counter_fd[i] >= 0)
+    {
+      ioctl(counter_fd[i], PERF_EVENT_IOC_DISABLE, 0);
+      if(read(counter_fd[i], &v, sizeof(v)) == sizeof(v))
+      {
+        sum[i] += v;
+      }
+    }
+  }
+}
+
+// Prints a counter figure in the table, or "-" when it was not counted.
+static void print_count(double v, int width, int decimals)
+{
+  if(v < 0)
+  {
+    printf(" %*s", width, "-");
+  }
+  else
+  {
+    printf(" %*.*f", width, decimals, v);
+  }
+}
+
+// Runs one warmup and trials timed trials of c over size byte messages.
+static int measure(const struct bench_case* c, uint8_t* out, const uint8_t* in, size_t size, int trials, struct result* r)
+{
+  uint64_t tc[MAX_TRIALS], tn[MAX_TRIALS];
+  uint64_t counts[COUNTERS] = { 0 };
+  size_t reps = (size < MIN_TRIAL_BYTES) ? MIN_TRIAL_BYTES / size : 1;
+  size_t k;
+  int i;
+
+  for(i = -1; i < trials; ++i)
+  {
+    uint64_t c0, n0;
+    if(i >= 0)
+    {
+      start_counters();
+    }
+    c0 = cycles();
+    n0 = nanoseconds();
+    for(k = 0; k < reps; ++k)
+    {
+      if(c->fn(out, in, size) != 0)
+      {
+        return -1;
+      }
+    }
+    if(i >= 0)
+    {
+      tc[i] = cycles() - c0;
+      tn[i] = nanoseconds() - n0;
+      stop_counters(counts);
+    }
+  }
+
+  for(i = 0; i < COUNTERS; ++i)
+  {
+    r->counts[i] = (counter_fd[i] >= 0) ? (double)counts[i] / (double)(size * reps * (size_t)trials) : -1;
+  }
+
+  for(i = 0; i < trials; ++i)
+  {
+    r->trial_mbs[i] = (double)(size * reps) * 1e3 / (double)tn[i];
+  }
+  r->cycles = (double)median(tc, trials) / (double)(size * reps);
+  r->mbs = (double)(size * reps) * 1e3 / (double)median(tn, trials);
+  r->spread = 100.0 * (double)(tn[trials * 3 / 4] - tn[trials / 4]) / (double)tn[trials / 2];
+  return 0;
+}
+
+static int compare_double(const void* a, const void* b)
+{
+  double x = *(const double*)a;
+  double y = *(const double*)b;
+  return (x > y) - (x < y);
+}
+
+static double median_mbs(const struct sample_set* s)
+{
+  double v[MAX_TRIALS];
+  memcpy(v, s->mbs, (size_t)s->n * sizeof(v[0]));
+  qsort(v, (size_t)s->n, sizeof(v[0]), compare_double);
+  return (s->n % 2) ? v[s->n / 2] : (v[s->n / 2 - 1] + v[s->n / 2]) / 2;
+}
+
+// One-sided Mann-Whitney U test: the probability of now being at least this much slower
+// than base by chance, from the normal approximation of U.
+static double slower_p(const struct sample_set* base, const struct sample_set* now)
+{
+  double u = 0, mean, sd;
+  int i, j;
+
+  for(i = 0; i < base->n; ++i)
+  {
+    for(j = 0; j < now->n; ++j)
+    {
+      u += (now->mbs[j] > base->mbs[i]) + 0.5 * (now->mbs[j] == base->mbs[i]);
+    }
+  }
+  mean = base->n * now->n / 2.0;
+  sd = sqrt(base->n * now->n * (base->n + now->n + 1) / 12.0);
+  return 0.5 * erfc((mean - u) / sd / sqrt(2.0));
+}
+
+static struct sample_set* find_samples(struct sample_set* sets, int count, const char* engine, const char* mode, size_t size)
+{
+  int i;
+  for(i = 0; i < count; ++i)
+  {
+    if(strcmp(sets[i].engine, engine) == 0 && strcmp(sets[i].mode, mode) == 0 && sets[i].size == size)
+    {
+      return &sets[i];
+    }
+  }
+  return NULL;
+}
+
+// Baseline files have one line per engine, mode and size: the three of them and the MB/s
+// of every trial, separated by blanks. Lines starting with # are comments.
+static int write_baseline(const char* path)
+{
+  FILE* f = fopen(path, "w");
+  int i, j;
+
+  if(f == NULL)
+  {
+    return -1;
+  }
+  fprintf(f, "# bench baseline: engine mode bytes, then MB/s of every trial\n");
+  for(i = 0; i < sample_count; ++i)
+  {
+    fprintf(f, "%s %s %zu", samples[i].engine, samples[i].mode, samples[i].size);
+    for(j = 0; j < samples[i].n; ++j)
+    {
+      fprintf(f, " %.3f", samples[i].mbs[j]);
+    }
+    fprintf(f, "\n");
+  }
+  return fclose(f);
+}
+
+// Reads up to max sample sets from path. Returns how many, or -1.
+static int read_baseline(const char* path, struct sample_set* sets, int max)
+{
+  char line[4096];
+  char* tok;
+  FILE* f = fopen(path, "r");
+  int count = 0;
+
+  if(f == NULL)
+  {
+    return -1;
+  }
+  while(count < max && fgets(line, sizeof(line), f) != NULL)
+  {
+    struct sample_set* s = &sets[count];
+    if(line[0] == '#' || sscanf(line, "%15s %15s %zu", s->engine, s->mode, &s->size) != 3)
+    {
+      continue;
+    }
+    strtok(line, " \t\n");
+    strtok(NULL, " \t\n");
+    strtok(NULL, " \t\n");
+    for(s->n = 0; s->n < MAX_TRIALS && (tok = strtok(NULL, " \t\n")) != NULL; ++s->n)
+    {
+      s->mbs[s->n] = atof(tok);
+    }
+    count += (s->n > 0);
+  }
+  fclose(f);
+  return count;
+}
+
+// Prints how every case of the baseline at path compares with this run. Returns the number
+// of regressions, or -1 if the baseline cannot be read.
+static int compare_baseline(const char* path, double threshold)
+{
+  static struct sample_set base[MAX_SAMPLE_SETS];
+  const struct sample_set* now;
+  double b, n, change, p;
+  int count, i, regressions = 0;
+
+  count = read_baseline(path, base, MAX_SAMPLE_SETS);
+  if(count < 0)
+  {
+    return -1;
+  }
+  printf("\ncompared with %s: slower by more than %.1f%% at p < %.2f is a regression\n", path, threshold, REGRESSION_ALPHA);
+  printf("%-6s %-14s %10s %10s %10s %8s %8s\n", "engine", "mode", "bytes", "base MB/s", "MB/s", "change", "p");
+  for(i = 0; i < count; ++i)
+  {
+    now = find_samples(samples, sample_count, base[i].engine, base[i].mode, base[i].size);
+    if(now == NULL)
+    {
+      printf("%-6s %-14s %10zu   not measured in this run\n", base[i].engine, base[i].mode, base[i].size);
+      continue;
+    }
+    b = median_mbs(&base[i]);
+    n = median_mbs(now);
+    change = 100.0 * (n - b) / b;
+    p = slower_p(&base[i], now);
+    printf("%-6s %-14s %10zu %10.2f %10.2f %7.1f%% %8.4f", base[i].engine, base[i].mode, base[i].size, b, n, change, p);
+    if(change < -threshold && p < REGRESSION_ALPHA)
+    {
+      printf("  REGRESSION");
+      ++regressions;
+    }
+    printf("\n");
+  }
+  printf("%d regression%s\n", regressions, (regressions == 1) ? "" : "s");
+  return regressions;
+}
+
+// Median nanoseconds per key of setting up SETUP_KEYS keys with kind 0: AES128_expand_key(),
+// 1: AES128_expand_keys(), 2: AES128_expand_dkey().
+static double key_setup(int kind, int trials)
+{
+  static uint8_t raw[SETUP_KEYS * 16];
+  static AES128_key_t keys[SETUP_KEYS];
+  static AES128_dkey_t dkeys[SETUP_KEYS];
+  uint64_t t[MAX_TRIALS];
+  int i, k;
+
+  for(k = 0; k < (int)sizeof(raw); ++k)
+  {
+    raw[k] = (uint8_t)(k * 7);
+  }
+  for(i = -1; i < trials; ++i)
+  {
+    uint64_t n0 = nanoseconds();
+    for(k = 0; k < SETUP_KEYS; ++k)
+    {
+      if(kind == 0)
+      {
+        AES128_expand_key(&keys[k], raw + k * 16);
+      }
+      else if(kind == 2)
+      {
+        AES128_expand_dkey(&dkeys[k], raw + k * 16);
+      }
+    }
+    if(kind == 1)
+    {
+      AES128_expand_keys(keys, raw, SETUP_KEYS);
+    }
+    if(i >= 0)
+    {
+      t[i] = nanoseconds() - n0;
+    }
+  }
+  return (double)median(t, trials) / SETUP_KEYS;
+}
+
+// Median nanoseconds of setting up a new key and processing blocks blocks with it.
+static double agility(const struct agility_case* c, uint8_t* out, const uint8_t* in, size_t blocks, int trials)
+{
+  static uint8_t raw[AGILITY_KEYS * 16];
+  uint64_t t[MAX_TRIALS];
+  int i, k;
+
+  for(k = 0; k < (int)sizeof(raw); ++k)
+  {
+    raw[k] = (uint8_t)(k * 13);
+  }
+  for(i = -1; i < trials; ++i)
+  {
+    uint64_t n0 = nanoseconds();
+    for(k = 0; k < AGILITY_KEYS; ++k)
+    {
+      if(c->fn(raw + k * 16, out, in, blocks * 16) != 0)
+      {
+        return -1;
+      }
+    }
+    if(i >= 0)
+    {
+      t[i] = nanoseconds() - n0;
+    }
+  }
+  return (double)median(t, trials) / AGILITY_KEYS;
+}
+
+static void evict(void)
+{
+  volatile uint8_t* p = evict_buf;
+  size_t i;
+
+  for(i = 0; i < EVICT_BYTES; i += 64)
+  {
+    p[i] += 1;
+  }
+}
+
+// Median latency in cycles (ns without rdtsc) of one ECB decryption, prepared by
+// evicting and/or preloading.
+static uint64_t first_block(int cold, int preload, int trials)
+{
+  static const uint8_t block[16] = { 0x3a, 0xd7, 0x7b, 0xb4, 0x0d, 0x7a, 0x36, 0x60, 0xa8, 0x9e, 0xca, 0xf3, 0x24, 0x66, 0xef, 0x97 };
+  uint64_t t[MAX_TRIALS];
+  uint8_t out[16];
+  int i;
+
+  for(i = 0; i < trials; ++i)
+  {
+    if(cold)
+    {
+      evict();
+    }
+    else
+    {
+      AES128_ECB_decrypt_keyed(block, &ctx, out);
+    }
+    if(preload)
+    {
+      AES128_preload(0);
+    }
+    t[i] = HAVE_CYCLES ? cycles() : nanoseconds();
+    AES128_ECB_decrypt_keyed(block, &ctx, out);
+    t[i] = (HAVE_CYCLES ? cycles() : nanoseconds()) - t[i];
+  }
+  return median(t, trials);
+}
+
+
+/*****************************************************************************/
+/* Public functions:                                                         */
+/*****************************************************************************/
+int main(int argc, char* argv[])
+{
+  const struct bench_case cases[] =
+  {
+    { "aes.c",  "ecb-enc",       ecb_encrypt },
+    { "aes.c",  "ecb-dec",       ecb_decrypt },
+    { "aes.c",  "ecb-dec-dkey",  ecb_decrypt_dkey },
+    { "aes.c",  "cbc-enc",       cbc_encrypt },
+    { "aes.c",  "cbc-dec",       cbc_decrypt },
+    { "aes.c",  "cbc-enc-keyed", cbc_encrypt_keyed },
+    { "aes.c",  "ctr-enc",       ctr_encrypt },
+    { "afalg",  "ecb-enc",       kernel_ecb_encrypt },
+    { "afalg",  "cbc-enc",       kernel_cbc_encrypt },
+    { "afalg",  "cbc-dec",       kernel_cbc_decrypt },
+    { "afalg",  "ctr-enc",       kernel_ctr_encrypt },
+  };
+  const struct agility_case agility_cases[] =
+  {
+    { "aes.c",  "cbc-enc",       agile_cbc_encrypt },
+    { "aes.c",  "cbc-dec",       agile_cbc_decrypt },
+    { "aes.c",  "ecb-dec-dkey",  agile_ecb_decrypt_dkey },
+    { "afalg",  "cbc-enc",       agile_kernel_cbc_encrypt },
+  };
+  const size_t agility_blocks[] = { 0, 1, 4, 16, AGILITY_MAX_BYTES / 16 };
+  const char* setup_names[] = { "expand_key", "expand_keys", "expand_dkey" };
+  const char* first_names[] = { "cold", "preloaded", "warm" };
+  const char* figure_names[] = { "instructions_per_byte", "ipc", "l1d_misses_per_block", "branch_misses_per_block" };
+  const char* csv_path = NULL;
+  const char* json_path = NULL;
+  const char* baseline_out = NULL;
+  const char* baseline_in = NULL;
+  double threshold = 5;
+  FILE* csv = NULL;
+  FILE* json = NULL;
+  size_t max_size = 256 * 1024, buf_size, size;
+  int trials = 7, have_kernel, have_kernel_ctr, first = 1, use_counters = 0, status = 0;
+  uint8_t* in;
+  uint8_t* out;
+  struct result r;
+  double figures[4];
+  unsigned i, k;
+  int c;
+
+  while((c = getopt(argc, argv, "s:n:pc:j:B:b:t:")) != -1)
+  {
+    switch(c)
+    {
+      case 's': max_size = (size_t)strtoull(optarg, NULL, 0); break;
+      case 'n': trials = atoi(optarg); break;
+      case 'p': use_counters = 1; break;
+      case 'c': csv_path = optarg; break;
+      case 'j': json_path = optarg; break;
+      case 'B': baseline_out = optarg; break;
+      case 'b': baseline_in = optarg; break;
+      case 't': threshold = atof(optarg); break;
+      default: usage();
+    }
+  }
+  if(max_size < 16 || trials < 1 || trials > MAX_TRIALS || threshold < 0 || (baseline_out != NULL && baseline_in != NULL))
+  {
+    usage();
+  }
+  if((csv_path != NULL && (csv = fopen(csv_path, "w")) == NULL)
+    || (json_path != NULL && (json = fopen(json_path, "w")) == NULL))
+  {
+    perror(csv_path != NULL && csv == NULL ? csv_path : json_path);
+    return 1;
+  }
+
+  buf_size = (max_size > AGILITY_MAX_BYTES) ? max_size : AGILITY_MAX_BYTES;
+  if(posix_memalign((void**)&in, AES128_KEY_ALIGN, buf_size) != 0 || posix_memalign((void**)&out, AES128_KEY_ALIGN, buf_size) != 0
+    || (evict_buf = calloc(1, EVICT_BYTES)) == NULL)
+  {
+    perror("bench");
+    return 1;
+  }
+  memset(in, 0x5a, buf_size);
+  AES128_expand_key(&ctx, key);
+  AES128_expand_dkey(&dctx, key);
+  have_kernel = afalg_open(&kernel_ecb, AFALG_ECB, key) == 0;
+  if(have_kernel && afalg_open(&kernel_cbc, AFALG_CBC, key) != 0)
+  {
+    afalg_close(&kernel_ecb);
+    have_kernel = 0;
+  }
+  have_kernel_ctr = have_kernel && afalg_open(&kernel_ctr, AFALG_CTR, key) == 0;
+
+  if(use_counters && open_counters() == 0)
+  {
+    fprintf(stderr, "bench: no hardware counters available (%s), continuing without\n", strerror(errno));
+  }
+
+  printf("%-6s %-14s %10s %10s %10s %8s", "engine", "mode", "bytes", "cycles/B", "MB/s", "spread");
+  if(use_counters)
+  {
+    printf(" %8s %6s %9s %9s", "instr/B", "IPC", "L1Dm/blk", "brm/blk");
+  }
+  printf("\n");
+  if(csv != NULL)
+  {
+    fprintf(csv, "engine,mode,bytes,cycles_per_byte,mb_per_s,spread_pct,instructions_per_byte,ipc,l1d_misses_per_block,branch_misses_per_block\n");
+  }
+  if(json != NULL)
+  {
+    fprintf(json, "{\n  \"trials\": %d,\n  \"results\": [", trials);
+  }
+
+  for(i = 0; i < sizeof(cases) / sizeof(cases[0]); ++i)
+  {
+    if(strcmp(cases[i].engine, "afalg") == 0 && (!have_kernel || (cases[i].fn == kernel_ctr_encrypt && !have_kernel_ctr)))
+    {
+      printf("%-6s %-14s %10s   not available on this kernel\n", cases[i].engine, cases[i].mode, "-");
+      continue;
+    }
+    for(size = 16; size <= max_size; size *= 4)
+    {
+      if(measure(&cases[i], out, in, size, trials, &r) != 0)
+      {
+        printf("%-6s %-14s %10zu   failed\n", cases[i].engine, cases[i].mode, size);
+        break;
+      }
+      // Per byte, IPC, and misses per 16 byte block; negative where not counted
+      figures[0] = r.counts[CTR_INSTRUCTIONS];
+      figures[1] = (r.counts[CTR_INSTRUCTIONS] >= 0 && r.counts[CTR_CYCLES] > 0) ? r.counts[CTR_INSTRUCTIONS] / r.counts[CTR_CYCLES] : -1;
+      figures[2] = r.counts[CTR_L1D_MISSES] * 16;
+      figures[3] = r.counts[CTR_BRANCH_MISSES] * 16;
+
+      printf("%-6s %-14s %10zu %10.1f %10.2f %7.1f%%", cases[i].engine, cases[i].mode, size, r.cycles, r.mbs, r.spread);
+      if(use_counters)
+      {
+        print_count(figures[0], 8, 1);
+        print_count(figures[1], 6, 2);
+        print_count(figures[2], 9, 3);
+        print_count(figures[3], 9, 3);
+      }
+      printf("\n");
+      fflush(stdout);
+
+      if(sample_count < MAX_SAMPLE_SETS)
+      {
+        struct sample_set* set = &samples[sample_count++];
+        snprintf(set->engine, sizeof(set->engine), "%s", cases[i].engine);
+        snprintf(set->mode, sizeof(set->mode), "%s", cases[i].mode);
+        set->size = size;
+        set->n = trials;
+        memcpy(set->mbs, r.trial_mbs, (size_t)trials * sizeof(set->mbs[0]));
+      }
+
+      if(csv != NULL)
+      {
+        fprintf(csv, "%s,%s,%zu,%.2f,%.3f,%.2f", cases[i].engine, cases[i].mode, size, r.cycles, r.mbs, r.spread);
+        for(k = 0; k < 4; ++k)
+        {
+          if(figures[k] >= 0)
+          {
+            fprintf(csv, ",%.4f", figures[k]);
+          }
+          else
+          {
+            fprintf(csv, ",");
+          }
+        }
+        fprintf(csv, "\n");
+      }
+      if(json != NULL)
+      {
+        fprintf(json, "%s\n    { \"engine\": \"%s\", \"mode\": \"%s\", \"bytes\": %zu, \"cycles_per_byte\": %.2f, \"mb_per_s\": %.3f, \"spread_pct\": %.2f",
+                first ? "" : ",", cases[i].engine, cases[i].mode, size, r.cycles, r.mbs, r.spread);
+        for(k = 0; k < 4; ++k)
+        {
+          if(figures[k] >= 0)
+          {
+            fprintf(json, ", \"%s\": %.4f", figure_names[k], figures[k]);
+          }
+          else
+          {
+            fprintf(json, ", \"%s\": null", figure_names[k]);
+          }
+        }
+        fprintf(json, " }");
+        first = 0;
+      }
+    }
+  }
+
+#if AES128_STAGE_TIMING
+  // Built by `make stages`: where the time of the matrix above went, stage by stage
+  printf("\n");
+  AES128_stage_report();
+#endif
+
+  printf("\n%-14s %12s %12s\n", "key setup", "ns/key", "keys/s");
+  if(json != NULL)
+  {
+    fprintf(json, "\n  ],\n  \"key_setup\": [");
+  }
+  for(i = 0; i < 3; ++i)
+  {
+    double ns = key_setup((int)i, trials);
+    printf("%-14s %12.1f %12.0f\n", setup_names[i], ns, 1e9 / ns);
+    if(json != NULL)
+    {
+      fprintf(json, "%s\n    { \"function\": \"%s\", \"ns_per_key\": %.1f }", i ? "," : "", setup_names[i], ns);
+    }
+  }
+
+  printf("\nkey agility, median ns per new key and message\n");
+  printf("%-6s %-14s %10s %10s %10s %10s %10s %10s\n", "engine", "mode", "setup", "+1 blk", "+4 blk", "+16 blk", "+64 blk", "even at");
+  if(json != NULL)
+  {
+    fprintf(json, "\n  ],\n  \"key_agility\": [");
+  }
+  first = 1;
+  for(i = 0; i < sizeof(agility_cases) / sizeof(agility_cases[0]); ++i)
+  {
+    double ns[5], per_block;
+    if(strcmp(agility_cases[i].engine, "afalg") == 0 && !have_kernel)
+    {
+      printf("%-6s %-14s %10s   not available on this kernel\n", agility_cases[i].engine, agility_cases[i].mode, "-");
+      continue;
+    }
+    printf("%-6s %-14s", agility_cases[i].engine, agility_cases[i].mode);
+    for(k = 0; k < 5; ++k)
+    {
+      ns[k] = agility(&agility_cases[i], out, in, agility_blocks[k], trials);
+      print_count(ns[k], 10, 1);
+      fflush(stdout);
+    }
+    // Where the data costs as much as the setup, from the cost of the blocks after the first
+    per_block = (ns[1] >= 0 && ns[4] >= 0) ? (ns[4] - ns[1]) / 63 : -1;
+    if(per_block > 0 && ns[0] >= 0)
+    {
+      printf(" %9.0fB\n", ns[0] / per_block * 16);
+    }
+    else
+    {
+      printf(" %10s\n", "-");
+    }
+    if(json != NULL)
+    {
+      fprintf(json, "%s\n    { \"engine\": \"%s\", \"mode\": \"%s\"", first ? "" : ",", agility_cases[i].engine, agility_cases[i].mode);
+      for(k = 0; k < 5; ++k)
+      {
+        fprintf(json, ", \"ns_%zu_blocks\": %.1f", agility_blocks[k], ns[k]);
+      }
+      fprintf(json, " }");
+      first = 0;
+    }
+  }
+
+  printf("\nfirst ECB decryption, median %s\n", HAVE_CYCLES ? "cycles" : "ns");
+  if(json != NULL)
+  {
+    fprintf(json, "\n  ],\n  \"first_block_%s\": {", HAVE_CYCLES ? "cycles" : "ns");
+  }
+  for(i = 0; i < 3; ++i)
+  {
+    // cold, cold after a preload, warm
+    uint64_t t = first_block(i < 2, i == 1, trials);
+    printf("  %-10s %10llu\n", first_names[i], (unsigned long long)t);
+    if(json != NULL)
+    {
+      fprintf(json, "%s \"%s\": %llu", i ? "," : "", first_names[i], (unsigned long long)t);
+    }
+  }
+
+  if(json != NULL)
+  {
+    fprintf(json, " }\n}\n");
+    fclose(json);
+  }
+  if(csv != NULL)
+  {
+    fclose(csv);
+  }
+  if(baseline_out != NULL && write_baseline(baseline_out) != 0)
+  {
+    perror(baseline_out);
+    status = 1;
+  }
+  if(baseline_in != NULL)
+  {
+    int regressions = compare_baseline(baseline_in, threshold);
+    if(regressions < 0)
+    {
+      perror(baseline_in);
+      status = 1;
+    }
+    else if(regressions > 0)
+    {
+      status = 3;
+    }
+  }
+  if(have_kernel)
+  {
+    afalg_close(&kernel_ecb);
+    afalg_close(&kernel_cbc);
+  }
+  if(have_kernel_ctr)
+  {
+    afalg_close(&kernel_ctr);
+  }
+  free(evict_buf);
+  free(in);
+  free(out);
+  return status;
+}
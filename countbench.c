@@ -0,0 +1,368 @@
+/*
+
+countbench - instructions and simulated cache misses per block, for comparing code changes
+without the noise of timing.
+
+  countbench [-b BLOCKS] [-t cachegrind|perf]
+
+  -b BLOCKS  blocks processed per mode (default 64)
+  -t TOOL    count with this tool only, default is cachegrind if installed, perf otherwise
+
+With cachegrind every mode is run in a process of its own under valgrind --tool=cachegrind
+--cache-sim=yes, once with BLOCKS blocks and once with none. The difference of the two
+runs, divided by BLOCKS, is the exact number of instructions per block and the number of
+L1 instruction, L1 data and last level misses of the simulated caches. Startup and the
+key setup, done once before the blocks, cancel out. Runs of the same binary always give
+the same numbers.
+
+With perf the instructions:u hardware counter is read around the blocks within this
+process, and the same read around no blocks is subtracted. This is exact to a few
+instructions, there is no cache simulation.
+
+Only aes.c is covered, the kernel's work behind AF_ALG is not counted by either tool.
+
+*/
+
+
+/*****************************************************************************/
+/* Includes:                                                                 */
+/*****************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/wait.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include "aes.h"
+
+
+/*****************************************************************************/
+/* Defines:                                                                  */
+/*****************************************************************************/
+#define MAX_BLOCKS 65536
+
+// Cachegrind events reported, in the order of the table.
+enum { EV_IR, EV_I1MR, EV_D1MR, EV_D1MW, EV_DLMR, EV_DLMW, EVENTS };
+
+
+/*****************************************************************************/
+/* Private variables:                                                        */
+/*****************************************************************************/
+static const uint8_t key[16] = { 0x2b, 0x7e, 0x15, 0x16, 0x28, 0xae, 0xd2, 0xa6, 0xab, 0xf7, 0x15, 0x88, 0x09, 0xcf, 0x4f, 0x3c };
+static const uint8_t iv[16]  = { 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f };
+
+static const char* const event_names[EVENTS] = { "Ir", "I1mr", "D1mr", "D1mw", "DLmr", "DLmw" };
+
+struct count_case
+{
+  const char* mode;
+  void (*fn)(uint8_t* out, const uint8_t* in, size_t len);
+};
+
+static AES128_key_t ctx;
+static AES128_dkey_t dctx;
+static uint8_t in[MAX_BLOCKS * 16];
+static uint8_t out[MAX_BLOCKS * 16];
+
+
+/*****************************************************************************/
+/* Private functions:                                                        */
+/*****************************************************************************/
+static void usage(void)
+{
+  fprintf(stderr, "usage: countbench [-b BLOCKS] [-t cachegrind|perf]\n");
+  exit(2);
+}
+
+static void ecb_encrypt(uint8_t* o, const uint8_t* i, size_t len)
+{
+  size_t k;
+  for(k = 0; k < len; k += 16)
+  {
+    AES128_ECB_encrypt_keyed(i + k, &ctx, o + k);
+  }
+}
+
+static void ecb_decrypt(uint8_t* o, const uint8_t* i, size_t len)
+{
+  size_t k;
+  for(k = 0; k < len; k += 16)
+  {
+    AES128_ECB_decrypt_keyed(i + k, &ctx, o + k);
+  }
+}
+
+static void ecb_decrypt_dkey(uint8_t* o, const uint8_t* i, size_t len)
+{
+  size_t k;
+  for(k = 0; k < len; k += 16)
+  {
+    AES128_ECB_decrypt_dkey(i + k, &dctx, o + k);
+  }
+}
+
+static void cbc_encrypt_keyed(uint8_t* o, const uint8_t* i, size_t len)
+{
+  AES128_packet_t packet = { i, o, (uint32_t)len, iv, &ctx };
+  AES128_CBC_encrypt_keyed_packets(&packet, 1);
+}
+
+static void cbc_decrypt_keyed(uint8_t* o, const uint8_t* i, size_t len)
+{
+  AES128_packet_t packet = { i, o, (uint32_t)len, iv, &ctx };
+  AES128_CBC_decrypt_keyed_packets(&packet, 1);
+}
+
+static const struct count_case cases[] =
+{
+  { "ecb-enc",       ecb_encrypt },
+  { "ecb-dec",       ecb_decrypt },
+  { "ecb-dec-dkey",  ecb_decrypt_dkey },
+  { "cbc-enc-keyed", cbc_encrypt_keyed },
+  { "cbc-dec-keyed", cbc_decrypt_keyed },
+};
+
+#define CASES (sizeof(cases) / sizeof(cases[0]))
+
+static void setup(void)
+{
+  memset(in, 0x5a, sizeof(in));
+  AES128_expand_key(&ctx, key);
+  AES128_expand_dkey(&dctx, key);
+}
+
+// Runs blocks blocks of case c under cachegrind and stores the summary counts in counts.
+// Returns 0, or -1 if valgrind could not be run or left no readable output.
+static int cachegrind(unsigned c, long blocks, double* counts)
+{
+  char self[4096], outfile[64], arg_out[96], arg_case[16], arg_blocks[32], line[4096], events[4096];
+  char* names[64];
+  char* tok;
+  FILE* f;
+  pid_t pid;
+  ssize_t len;
+  int status, n = 0, i, k, have_summary = 0;
+
+  // Resolved here, under valgrind /proc/self/exe would be valgrind itself
+  len = readlink("/proc/self/exe", self, sizeof(self) - 1);
+  if(len < 0)
+  {
+    return -1;
+  }
+  self[len] = 0;
+  snprintf(outfile, sizeof(outfile), "/tmp/countbench.%ld.out", (long)getpid());
+  snprintf(arg_out, sizeof(arg_out), "--cachegrind-out-file=%s", outfile);
+  snprintf(arg_case, sizeof(arg_case), "%u", c);
+  snprintf(arg_blocks, sizeof(arg_blocks), "%ld", blocks);
+
+  pid = fork();
+  if(pid == 0)
+  {
+    int null = open("/dev/null", O_WRONLY);
+    dup2(null, 1);
+    dup2(null, 2);
+    execlp("valgrind", "valgrind", "--tool=cachegrind", "--cache-sim=yes", arg_out,
+           self, "-x", arg_case, "-b", arg_blocks, (char*)NULL);
+    _exit(127);
+  }
+  if(pid < 0 || waitpid(pid, &status, 0) != pid || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+  {
+    unlink(outfile);
+    return -1;
+  }
+
+  // The out file names its counts in an "events:" line and totals them in "summary:"
+  f = fopen(outfile, "r");
+  if(f == NULL)
+  {
+    return -1;
+  }
+  for(k = 0; k < EVENTS; ++k)
+  {
+    counts[k] = -1;
+  }
+  while(fgets(line, sizeof(line), f) != NULL)
+  {
+    if(strncmp(line, "events:", 7) == 0)
+    {
+      memcpy(events, line, sizeof(events));
+      n = 0;
+      for(tok = strtok(events + 7, " \n"); tok != NULL && n < 64; tok = strtok(NULL, " \n"))
+      {
+        names[n++] = tok;
+      }
+    }
+    else if(strncmp(line, "summary:", 8) == 0)
+    {
+      have_summary = 1;
+      i = 0;
+      for(tok = strtok(line + 8, " \n"); tok != NULL && i < n; tok = strtok(NULL, " \n"), ++i)
+      {
+        for(k = 0; k < EVENTS; ++k)
+        {
+          if(strcmp(names[i], event_names[k]) == 0)
+          {
+            counts[k] = atof(tok);
+          }
+        }
+      }
+    }
+  }
+  fclose(f);
+  unlink(outfile);
+  return (have_summary && counts[EV_IR] >= 0) ? 0 : -1;
+}
+
+// User space instructions of running blocks blocks of case c, -1 without the counter.
+static double perf_instructions(int fd, unsigned c, long blocks)
+{
+  uint64_t v;
+
+  ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+  ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+  if(blocks > 0)
+  {
+    cases[c].fn(out, in, (size_t)blocks * 16);
+  }
+  ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+  if(read(fd, &v, sizeof(v)) != sizeof(v))
+  {
+    return -1;
+  }
+  return (double)v;
+}
+
+static int open_instructions(void)
+{
+  struct perf_event_attr attr;
+
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = PERF_TYPE_HARDWARE;
+  attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+  attr.disabled = 1;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  return (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static void print_count(double v)
+{
+  if(v < 0)
+  {
+    printf(" %10s", "-");
+  }
+  else
+  {
+    printf(" %10.2f", v);
+  }
+}
+
+
+/*****************************************************************************/
+/* Public functions:                                                         */
+/*****************************************************************************/
+int main(int argc, char* argv[])
+{
+  const char* tool = NULL;
+  double full[EVENTS], empty[EVENTS], per_block[EVENTS];
+  long blocks = 64;
+  int child_case = -1, fd = -1, use_cachegrind, c, k;
+  unsigned i;
+
+  while((c = getopt(argc, argv, "b:t:x:")) != -1)
+  {
+    switch(c)
+    {
+      case 'b': blocks = atol(optarg); break;
+      case 't': tool = optarg; break;
+      case 'x': child_case = atoi(optarg); break;   // internal: one run under cachegrind
+      default: usage();
+    }
+  }
+  if(blocks < 0 || blocks > MAX_BLOCKS || (tool != NULL && strcmp(tool, "cachegrind") != 0 && strcmp(tool, "perf") != 0))
+  {
+    usage();
+  }
+
+  setup();
+  if(child_case >= 0)
+  {
+    if((unsigned)child_case >= CASES)
+    {
+      usage();
+    }
+    if(blocks > 0)
+    {
+      cases[child_case].fn(out, in, (size_t)blocks * 16);
+    }
+    return 0;
+  }
+  if(blocks == 0)
+  {
+    usage();
+  }
+
+  use_cachegrind = (tool == NULL || strcmp(tool, "cachegrind") == 0) && cachegrind(0, 0, empty) == 0;
+  if(!use_cachegrind && (tool == NULL || strcmp(tool, "perf") == 0))
+  {
+    fd = open_instructions();
+  }
+  if(!use_cachegrind && fd < 0)
+  {
+    fprintf(stderr, "countbench: neither valgrind nor the instructions counter of perf is available\n");
+    return 1;
+  }
+
+  printf("counted with %s, per block of %ld\n", use_cachegrind ? "cachegrind" : "perf instructions:u", blocks);
+  printf("%-14s %10s %10s %10s %10s %10s %10s\n", "mode", "instr", "I1 miss", "D1r miss", "D1w miss", "LLr miss", "LLw miss");
+  for(i = 0; i < CASES; ++i)
+  {
+    for(k = 0; k < EVENTS; ++k)
+    {
+      per_block[k] = -1;
+    }
+    if(use_cachegrind)
+    {
+      if(cachegrind(i, 0, empty) != 0 || cachegrind(i, blocks, full) != 0)
+      {
+        printf("%-14s   failed under valgrind\n", cases[i].mode);
+        continue;
+      }
+      for(k = 0; k < EVENTS; ++k)
+      {
+        per_block[k] = (full[k] >= 0 && empty[k] >= 0) ? (full[k] - empty[k]) / blocks : -1;
+      }
+    }
+    else
+    {
+      // Once uncounted, so that the counted run starts with warm caches and resolved symbols
+      perf_instructions(fd, i, blocks);
+      full[EV_IR] = perf_instructions(fd, i, blocks);
+      empty[EV_IR] = perf_instructions(fd, i, 0);
+      if(full[EV_IR] >= 0 && empty[EV_IR] >= 0)
+      {
+        per_block[EV_IR] = (full[EV_IR] - empty[EV_IR]) / blocks;
+      }
+    }
+
+    printf("%-14s", cases[i].mode);
+    for(k = 0; k < EVENTS; ++k)
+    {
+      print_count(per_block[k]);
+    }
+    printf("\n");
+    fflush(stdout);
+  }
+
+  if(fd >= 0)
+  {
+    close(fd);
+  }
+  return 0;
+}
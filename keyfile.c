@@ -0,0 +1,257 @@
+/*
+
+Files of pre-expanded AES128 keys, see keyfile.h for the format.
+
+keyfile_save() writes to a temporary file next to path and renames it into place, so
+a service starting concurrently sees either the old or the new file, never half of one.
+The file is created with mode 0600, the schedules are as secret as the keys.
+
+*/
+
+
+/*****************************************************************************/
+/* Includes:                                                                 */
+/*****************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "keyfile.h"
+
+
+/*****************************************************************************/
+/* Defines:                                                                  */
+/*****************************************************************************/
+// 64 bytes, or more when AES128_key_t needs more, so the mapped records stay aligned.
+#define HEADER_LEN ((AES128_KEY_ALIGN > 64) ? AES128_KEY_ALIGN : 64)
+
+_Static_assert(HEADER_LEN % _Alignof(AES128_key_t) == 0, "key file records must start aligned");
+
+// Bytes of a record that hold round keys, the rest is padding.
+#define ROUND_KEY_LEN sizeof(((AES128_key_t*)0)->RoundKey)
+
+
+/*****************************************************************************/
+/* Private variables:                                                        */
+/*****************************************************************************/
+static const uint8_t magic[4] = { 'A', 'E', 'S', 'X' };
+
+struct keyfile
+{
+  uint8_t* map;
+  size_t maplen;
+  uint32_t count;
+};
+
+
+/*****************************************************************************/
+/* Private functions:                                                        */
+/*****************************************************************************/
+static void put16(uint8_t* p, uint16_t v)
+{
+  p[0] = (uint8_t)v;
+  p[1] = (uint8_t)(v >> 8);
+}
+
+static void put32(uint8_t* p, uint32_t v)
+{
+  put16(p, (uint16_t)v);
+  put16(p + 2, (uint16_t)(v >> 16));
+}
+
+static uint16_t get16(const uint8_t* p)
+{
+  return (uint16_t)(p[0] | (p[1] << 8));
+}
+
+static uint32_t get32(const uint8_t* p)
+{
+  return get16(p) | ((uint32_t)get16(p + 2) << 16);
+}
+
+static void put64(uint8_t* p, uint64_t v)
+{
+  put32(p, (uint32_t)v);
+  put32(p + 4, (uint32_t)(v >> 32));
+}
+
+static uint64_t get64(const uint8_t* p)
+{
+  return get32(p) | ((uint64_t)get32(p + 4) << 32);
+}
+
+// Fletcher-64 over the round keys as little-endian 32 bit words. Verifying it has to be
+// cheaper than expanding the keys again, which rules out a bytewise CRC.
+static uint64_t checksum(const AES128_key_t* keys, uint32_t count)
+{
+  uint64_t sum1 = 0, sum2 = 0;
+  uint32_t i, j;
+
+  for(i = 0; i < count; ++i)
+  {
+    for(j = 0; j < ROUND_KEY_LEN; j += 4)
+    {
+      sum1 += get32(keys[i].RoundKey + j);
+      sum2 += sum1;
+    }
+    // A record adds less than 2^44 to each sum, reducing once per record is enough
+    sum1 %= 0xffffffffu;
+    sum2 %= 0xffffffffu;
+  }
+  return (sum2 << 32) | sum1;
+}
+
+
+/*****************************************************************************/
+/* Public functions:                                                         */
+/*****************************************************************************/
+int keyfile_save(const char* path, const AES128_key_t* keys, uint32_t count)
+{
+  uint8_t header[HEADER_LEN];
+  AES128_key_t record;
+  char* tmp;
+  FILE* f;
+  uint32_t i;
+  int fd;
+  int rc = 0;
+
+  memset(header, 0, sizeof(header));
+  memcpy(header, magic, sizeof(magic));
+  put16(header + 4, KEYFILE_VERSION);
+  put16(header + 6, KEYFILE_LAYOUT_FORWARD);
+  put32(header + 8, sizeof(AES128_key_t));
+  put32(header + 12, count);
+  put64(header + 16, checksum(keys, count));
+
+  // A fresh file of a unique name, readable by the owner only: it holds the key schedules,
+  // and neither a concurrent save nor a planted symlink may take its place
+  tmp = malloc(strlen(path) + 8);
+  if(tmp == NULL)
+  {
+    return -1;
+  }
+  sprintf(tmp, "%s.XXXXXX", path);
+  fd = mkstemp(tmp);
+  if(fd < 0)
+  {
+    free(tmp);
+    return -1;
+  }
+  f = (fchmod(fd, 0600) == 0) ? fdopen(fd, "wb") : NULL;
+  if(f == NULL)
+  {
+    close(fd);
+    unlink(tmp);
+    free(tmp);
+    return -1;
+  }
+
+  if(fwrite(header, sizeof(header), 1, f) != 1)
+  {
+    rc = -1;
+  }
+  for(i = 0; rc == 0 && i < count; ++i)
+  {
+    // Padding is written as zeros, not as whatever the caller's memory held
+    memset(&record, 0, sizeof(record));
+    memcpy(record.RoundKey, keys[i].RoundKey, ROUND_KEY_LEN);
+    if(fwrite(&record, sizeof(record), 1, f) != 1)
+    {
+      rc = -1;
+    }
+  }
+
+  if(fclose(f) != 0 || rc != 0 || rename(tmp, path) != 0)
+  {
+    unlink(tmp);
+    rc = -1;
+  }
+  memset(&record, 0, sizeof(record));
+  free(tmp);
+  return rc;
+}
+
+keyfile_t* keyfile_open(const char* path)
+{
+  struct stat st;
+  keyfile_t* kf;
+  void* map;
+  int fd;
+
+  fd = open(path, O_RDONLY);
+  if(fd < 0)
+  {
+    return NULL;
+  }
+  if(fstat(fd, &st) != 0 || (size_t)st.st_size < HEADER_LEN)
+  {
+    close(fd);
+    return NULL;
+  }
+  map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if(map == MAP_FAILED)
+  {
+    return NULL;
+  }
+
+  kf = malloc(sizeof(*kf));
+  if(kf == NULL)
+  {
+    munmap(map, (size_t)st.st_size);
+    return NULL;
+  }
+  kf->map = map;
+  kf->maplen = (size_t)st.st_size;
+  kf->count = get32(kf->map + 12);
+
+  if(memcmp(kf->map, magic, sizeof(magic)) != 0
+    || get16(kf->map + 4) != KEYFILE_VERSION
+    || get16(kf->map + 6) != KEYFILE_LAYOUT_FORWARD
+    || get32(kf->map + 8) != sizeof(AES128_key_t)
+    || HEADER_LEN + (size_t)kf->count * sizeof(AES128_key_t) > kf->maplen
+    || checksum(keyfile_keys(kf), kf->count) != get64(kf->map + 16))
+  {
+    keyfile_close(kf);
+    return NULL;
+  }
+  return kf;
+}
+
+void keyfile_close(keyfile_t* kf)
+{
+  if(kf != NULL)
+  {
+    munmap(kf->map, kf->maplen);
+    free(kf);
+  }
+}
+
+const AES128_key_t* keyfile_keys(const keyfile_t* kf)
+{
+  return (const AES128_key_t*)(kf->map + HEADER_LEN);
+}
+
+uint32_t keyfile_count(const keyfile_t* kf)
+{
+  return kf->count;
+}
+
+int32_t keyfile_load(const char* path, AES128_key_t* keys, uint32_t max)
+{
+  keyfile_t* kf = keyfile_open(path);
+  uint32_t n;
+
+  if(kf == NULL)
+  {
+    return -1;
+  }
+  n = (kf->count < max) ? kf->count : max;
+  memcpy(keys, keyfile_keys(kf), (size_t)n * sizeof(AES128_key_t));
+  keyfile_close(kf);
+  return (int32_t)n;
+}
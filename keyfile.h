@@ -0,0 +1,58 @@
+#ifndef _KEYFILE_H_
+#define _KEYFILE_H_
+
+#include <stdint.h>
+#include "aes.h"
+
+
+// Files of pre-expanded AES128 keys, so a restarting service can skip key expansion.
+//
+// The format is stable and versioned. A 64 byte header (AES128_CACHE_LINE bytes in builds
+// with larger lines) is followed by count records:
+//
+//   offset  size
+//        0     4  magic "AESX"
+//        4     2  format version, KEYFILE_VERSION
+//        6     2  round key layout, KEYFILE_LAYOUT_FORWARD
+//        8     4  record size in bytes
+//       12     4  number of records
+//       16     8  Fletcher-64 checksum over the 176 round key bytes of every record
+//       24    40  zero, more up to the end of a larger header
+//
+// Integers are little-endian. Each record is one AES128_key_t: the 11 round keys in
+// encryption order, zero padded to the record size (192 bytes with the default
+// AES128_CACHE_LINE). The cipher reads the same schedule backwards for decryption, so
+// there is no separate inverse schedule; the last round key at offset 160 is what
+// AES128_dkey_t holds.
+//
+// The records follow the header back to back, so a mapped file is used as an array of
+// AES128_key_t in place, and files are only accepted by builds of the same record size:
+//
+//   keyfile_save("keys.aesx", keys, n);
+//   ...
+//   kf = keyfile_open("keys.aesx");
+//   packet.key = &keyfile_keys(kf)[key_id];
+
+#define KEYFILE_VERSION        1
+#define KEYFILE_LAYOUT_FORWARD 1
+
+typedef struct keyfile keyfile_t;
+
+// Writes count expanded keys to path, readable by the owner only. Returns 0, or -1 with errno set.
+int keyfile_save(const char* path, const AES128_key_t* keys, uint32_t count);
+
+// Maps path read-only after checking its header and checksum. Returns NULL if the file is not
+// a key file of this build's record size, or is damaged.
+keyfile_t* keyfile_open(const char* path);
+
+void keyfile_close(keyfile_t* kf);
+
+// The mapped keys, valid until keyfile_close().
+const AES128_key_t* keyfile_keys(const keyfile_t* kf);
+uint32_t keyfile_count(const keyfile_t* kf);
+
+// Copies up to max keys from path into keys. Returns the number copied, or -1.
+int32_t keyfile_load(const char* path, AES128_key_t* keys, uint32_t max);
+
+
+#endif //_KEYFILE_H_
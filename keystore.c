@@ -0,0 +1,285 @@
+/*
+
+Shared-memory table of expanded AES128 keys, see keystore.h.
+
+The shared object holds a header followed by a power-of-two number of entries. Keys
+are placed by open addressing with linear probing on their ID. An entry with sequence
+number 0 has never been used, odd sequence numbers mark an entry being written.
+Entries are never removed, so a probe for an ID can stop at the first unused entry.
+
+*/
+
+
+/*****************************************************************************/
+/* Includes:                                                                 */
+/*****************************************************************************/
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "keystore.h"
+
+
+/*****************************************************************************/
+/* Defines:                                                                  */
+/*****************************************************************************/
+#define KEYSTORE_MAGIC   0x4b534541  // "AESK"
+#define KEYSTORE_VERSION 3
+
+// Offset of the first entry: the header rounded up to the entry alignment, so the round
+// keys start on cache lines.
+#define ENTRIES_OFFSET ((sizeof(struct keystore_header) + AES128_KEY_ALIGN - 1) / AES128_KEY_ALIGN * AES128_KEY_ALIGN)
+
+// Keys expanded per AES128_expand_keys() call in keystore_put().
+#define PUT_BATCH 64
+
+// Largest capacity of keystore_create(), the table has twice as many entries.
+#define MAX_CAPACITY (1u << 30)
+
+
+/*****************************************************************************/
+/* Private variables:                                                        */
+/*****************************************************************************/
+struct keystore_header
+{
+  uint32_t magic;
+  uint32_t version;
+  uint32_t capacity;     // number of entries, a power of two
+  uint32_t count;        // entries in use
+  uint64_t generation;
+};
+
+// The round keys without the padding of AES128_key_t, ID and sequence number go in the
+// rest of the last line: 192 bytes per entry with 64 byte lines.
+struct keystore_entry
+{
+  uint8_t round_keys[sizeof(((AES128_key_t*)0)->RoundKey)];
+  uint32_t id;
+  uint32_t seq;
+} AES128_ALIGNED;
+
+struct keystore
+{
+  struct keystore_header* header;
+  struct keystore_entry* entries;
+  size_t maplen;
+};
+
+
+/*****************************************************************************/
+/* Private functions:                                                        */
+/*****************************************************************************/
+static uint32_t slot_of(const keystore_t* ks, uint32_t id)
+{
+  return (id * 2654435761u) & (ks->header->capacity - 1);
+}
+
+// Finds the entry of id, or the unused entry where it would go. NULL if the table is full.
+static struct keystore_entry* find(const keystore_t* ks, uint32_t id)
+{
+  uint32_t mask = ks->header->capacity - 1;
+  uint32_t i, n;
+  struct keystore_entry* e;
+
+  for(i = slot_of(ks, id), n = 0; n <= mask; i = (i + 1) & mask, ++n)
+  {
+    e = &ks->entries[i];
+    if(__atomic_load_n(&e->seq, __ATOMIC_ACQUIRE) == 0 || e->id == id)
+    {
+      return e;
+    }
+  }
+  return NULL;
+}
+
+static keystore_t* map_store(int fd, size_t len, int prot)
+{
+  keystore_t* ks = malloc(sizeof(*ks));
+  void* map;
+
+  if(ks == NULL)
+  {
+    return NULL;
+  }
+  map = mmap(NULL, len, prot, MAP_SHARED, fd, 0);
+  if(map == MAP_FAILED)
+  {
+    free(ks);
+    return NULL;
+  }
+  ks->header = map;
+  ks->entries = (struct keystore_entry*)((uint8_t*)map + ENTRIES_OFFSET);
+  ks->maplen = len;
+  return ks;
+}
+
+
+/*****************************************************************************/
+/* Public functions:                                                         */
+/*****************************************************************************/
+keystore_t* keystore_create(const char* name, uint32_t capacity)
+{
+  keystore_t* ks;
+  uint32_t entries = 1;
+  size_t len;
+  int fd;
+
+  // Keep the table at most half full, so probe sequences stay short. Twice the capacity
+  // has to fit the 32 bit entry count.
+  if(capacity > MAX_CAPACITY)
+  {
+    errno = EINVAL;
+    return NULL;
+  }
+  while(entries < 2 * capacity)
+  {
+    entries <<= 1;
+  }
+  len = ENTRIES_OFFSET + (size_t)entries * sizeof(struct keystore_entry);
+
+  // A new object instead of truncating an existing one, which would pull the pages out
+  // from under processes that still have it mapped. They keep the old store.
+  if(shm_unlink(name) != 0 && errno != ENOENT)
+  {
+    return NULL;
+  }
+  fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+  if(fd < 0)
+  {
+    return NULL;
+  }
+  if(ftruncate(fd, (off_t)len) != 0)
+  {
+    close(fd);
+    shm_unlink(name);
+    return NULL;
+  }
+  ks = map_store(fd, len, PROT_READ | PROT_WRITE);
+  close(fd);
+  if(ks == NULL)
+  {
+    return NULL;
+  }
+
+  // ftruncate zero-filled the object, all entries are unused
+  ks->header->version = KEYSTORE_VERSION;
+  ks->header->capacity = entries;
+  __atomic_store_n(&ks->header->magic, KEYSTORE_MAGIC, __ATOMIC_RELEASE);
+  return ks;
+}
+
+keystore_t* keystore_open(const char* name)
+{
+  struct stat st;
+  keystore_t* ks;
+  int fd;
+
+  fd = shm_open(name, O_RDONLY, 0);
+  if(fd < 0)
+  {
+    return NULL;
+  }
+  if(fstat(fd, &st) != 0 || (size_t)st.st_size < ENTRIES_OFFSET)
+  {
+    close(fd);
+    return NULL;
+  }
+  ks = map_store(fd, (size_t)st.st_size, PROT_READ);
+  close(fd);
+  if(ks == NULL)
+  {
+    return NULL;
+  }
+
+  if(__atomic_load_n(&ks->header->magic, __ATOMIC_ACQUIRE) != KEYSTORE_MAGIC
+    || ks->header->version != KEYSTORE_VERSION
+    || ENTRIES_OFFSET + (size_t)ks->header->capacity * sizeof(struct keystore_entry) > ks->maplen)
+  {
+    keystore_close(ks);
+    return NULL;
+  }
+  return ks;
+}
+
+void keystore_close(keystore_t* ks)
+{
+  if(ks != NULL)
+  {
+    munmap(ks->header, ks->maplen);
+    free(ks);
+  }
+}
+
+int keystore_unlink(const char* name)
+{
+  return shm_unlink(name);
+}
+
+int keystore_put(keystore_t* ks, const uint32_t* ids, const uint8_t* keys, uint32_t count)
+{
+  AES128_key_t expanded[PUT_BATCH];
+  struct keystore_entry* e;
+  uint32_t i, n, k;
+  int rc = 0;
+
+  for(i = 0; i < count; i += n)
+  {
+    n = (count - i < PUT_BATCH) ? count - i : PUT_BATCH;
+    AES128_expand_keys(expanded, keys + i * 16, n);
+
+    for(k = 0; k < n; ++k)
+    {
+      e = find(ks, ids[i + k]);
+      if(e == NULL)
+      {
+        rc = -1;
+        continue;
+      }
+      if(e->seq == 0)
+      {
+        e->id = ids[i + k];
+        ++ks->header->count;
+      }
+
+      // Odd sequence number while the schedule is being replaced (this also publishes the ID)
+      __atomic_store_n(&e->seq, e->seq + 1, __ATOMIC_RELEASE);
+      __atomic_thread_fence(__ATOMIC_RELEASE);
+      memcpy(e->round_keys, expanded[k].RoundKey, sizeof(e->round_keys));
+      __atomic_store_n(&e->seq, e->seq + 1, __ATOMIC_RELEASE);
+    }
+  }
+
+  __atomic_add_fetch(&ks->header->generation, 1, __ATOMIC_RELEASE);
+  memset(expanded, 0, sizeof(expanded));
+  return rc;
+}
+
+int keystore_get(const keystore_t* ks, uint32_t id, AES128_key_t* key)
+{
+  struct keystore_entry* e = find(ks, id);
+  uint32_t before, after;
+
+  if(e == NULL || __atomic_load_n(&e->seq, __ATOMIC_ACQUIRE) == 0)
+  {
+    return -1;
+  }
+
+  do
+  {
+    before = __atomic_load_n(&e->seq, __ATOMIC_ACQUIRE);
+    memcpy(key->RoundKey, e->round_keys, sizeof(e->round_keys));
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    after = __atomic_load_n(&e->seq, __ATOMIC_RELAXED);
+  } while((before & 1) || before != after);
+
+  return 0;
+}
+
+uint64_t keystore_generation(const keystore_t* ks)
+{
+  return __atomic_load_n(&ks->header->generation, __ATOMIC_ACQUIRE);
+}
@@ -0,0 +1,51 @@
+#ifndef _KEYSTORE_H_
+#define _KEYSTORE_H_
+
+#include <stdint.h>
+#include "aes.h"
+
+
+// Shared-memory table of expanded AES128 keys.
+//
+// A parent process creates the store and puts its keys into it before forking, workers
+// open it read-only and look keys up by ID - no worker expands a key itself, and the
+// round keys exist once in memory instead of once per process.
+//
+// Keys may be replaced while workers run. Every entry is guarded by a sequence counter,
+// keystore_get() retries until it has copied a consistent schedule, and the store's
+// generation counter is bumped after each change so workers can cache copies and
+// refetch only when keystore_generation() moves.
+//
+//   parent:  ks = keystore_create("/tenant-keys", 4096);
+//            keystore_put(ks, ids, raw_keys, n);
+//            fork() ...
+//   worker:  ks = keystore_open("/tenant-keys");
+//            keystore_get(ks, id, &key);
+
+typedef struct keystore keystore_t;
+
+// Creates the shared memory object name with room for capacity keys, at most 2^30.
+// An existing store of that name is unlinked first: processes that have it open keep
+// the old keys, new keystore_open() calls get the new store.
+keystore_t* keystore_create(const char* name, uint32_t capacity);
+
+// Maps an existing store read-only.
+keystore_t* keystore_open(const char* name);
+
+void keystore_close(keystore_t* ks);
+
+// Removes the shared memory object, mappings stay valid until closed.
+int keystore_unlink(const char* name);
+
+// Expands count keys (16 bytes each, back to back) and stores them under ids[], replacing
+// keys with the same ID. Only on a store from keystore_create(). Returns 0, or -1 when full.
+int keystore_put(keystore_t* ks, const uint32_t* ids, const uint8_t* keys, uint32_t count);
+
+// Copies the expanded key with the given ID. Returns 0, or -1 if there is none.
+int keystore_get(const keystore_t* ks, uint32_t id, AES128_key_t* key);
+
+// Changes whenever keys are put into the store.
+uint64_t keystore_generation(const keystore_t* ks);
+
+
+#endif //_KEYSTORE_H_
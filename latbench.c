@@ -0,0 +1,317 @@
+/*
+
+latbench - latency distribution of single small AES128 calls.
+
+  latbench [-n CALLS] [-N COLDCALLS] [-e EVICTBYTES] [-k]
+
+  -n CALLS       calls measured per function and size with warm caches (default 100000)
+  -N COLDCALLS   calls measured with cold caches (default 2000)
+  -e EVICTBYTES  memory walked before every cold call (default 64M)
+  -k             include the key setup in every call
+
+Times every call of single-block ECB and of CBC messages from 64 bytes to 1K on its own
+and records the times in a histogram with logarithmic buckets of 32 linear steps each,
+so every value is kept to within about 3% however far the tail reaches. Reported are
+p50, p90, p99, p99.9 and the maximum, in cycles on x86 and in nanoseconds elsewhere.
+
+Every case is run warm, back to back, and cold, after the caches were flushed by
+walking EVICTBYTES of memory, which is how the first message after an idle period
+sees them.
+
+Without -k the keys are expanded beforehand, as a service holding its keys would do.
+With -k the key setup is part of every call: ECB goes through AES128_ECB_encrypt()
+and AES128_ECB_decrypt(), which expand the key, the other cases expand an
+AES128_dkey_t or go through the CBC buffer functions with the raw key.
+
+*/
+
+
+/*****************************************************************************/
+/* Includes:                                                                 */
+/*****************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "aes.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+  #include <x86intrin.h>
+  #define HAVE_CYCLES 1
+#else
+  #define HAVE_CYCLES 0
+#endif
+
+
+/*****************************************************************************/
+/* Defines:                                                                  */
+/*****************************************************************************/
+// A bucket per value below 2^SUB_BITS, then 2^SUB_BITS buckets per power of two.
+#define SUB_BITS 5
+#define SUB_BUCKETS (1 << SUB_BITS)
+#define BUCKETS ((64 - SUB_BITS + 1) * SUB_BUCKETS)
+
+#define MAX_MESSAGE 1024
+
+
+/*****************************************************************************/
+/* Private variables:                                                        */
+/*****************************************************************************/
+static const uint8_t key[16] = { 0x2b, 0x7e, 0x15, 0x16, 0x28, 0xae, 0xd2, 0xa6, 0xab, 0xf7, 0x15, 0x88, 0x09, 0xcf, 0x4f, 0x3c };
+static const uint8_t iv[16]  = { 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f };
+
+struct histogram
+{
+  uint64_t count[BUCKETS];
+  uint64_t total;
+  uint64_t max;
+};
+
+// One measured call, processing len bytes from in to out.
+struct lat_case
+{
+  const char* mode;
+  size_t len;
+  void (*fn)(uint8_t* out, const uint8_t* in, size_t len);
+};
+
+static AES128_key_t ctx;
+static AES128_dkey_t dctx;
+static int with_key_setup;
+
+static uint8_t* evict_buf;
+static size_t evict_bytes = 64 * 1024 * 1024;
+
+
+/*****************************************************************************/
+/* Private functions:                                                        */
+/*****************************************************************************/
+static void usage(void)
+{
+  fprintf(stderr, "usage: latbench [-n CALLS] [-N COLDCALLS] [-e EVICTBYTES] [-k]\n");
+  exit(2);
+}
+
+static uint64_t timestamp(void)
+{
+#if HAVE_CYCLES
+  return __rdtsc();
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+#endif
+}
+
+static unsigned bucket_of(uint64_t v)
+{
+  unsigned shift = 0;
+
+  if(v < SUB_BUCKETS)
+  {
+    return (unsigned)v;
+  }
+  // Position of the highest bit above the SUB_BITS kept ones
+  while((v >> shift) >= 2 * SUB_BUCKETS)
+  {
+    ++shift;
+  }
+  return (shift + 1) * SUB_BUCKETS + (unsigned)(v >> shift) - SUB_BUCKETS;
+}
+
+// Highest value that falls into bucket b.
+static uint64_t value_of(unsigned b)
+{
+  unsigned shift;
+
+  if(b < SUB_BUCKETS)
+  {
+    return b;
+  }
+  shift = b / SUB_BUCKETS - 1;
+  return ((uint64_t)(b % SUB_BUCKETS + SUB_BUCKETS + 1) << shift) - 1;
+}
+
+static void record(struct histogram* h, uint64_t v)
+{
+  ++h->count[bucket_of(v)];
+  ++h->total;
+  h->max = (v > h->max) ? v : h->max;
+}
+
+// The value below which the fraction q of all recorded values lies.
+static uint64_t percentile(const struct histogram* h, double q)
+{
+  uint64_t seen = 0, rank = (uint64_t)(q * h->total);
+  unsigned b;
+
+  for(b = 0; b < BUCKETS; ++b)
+  {
+    seen += h->count[b];
+    if(seen > rank)
+    {
+      return (value_of(b) < h->max) ? value_of(b) : h->max;
+    }
+  }
+  return h->max;
+}
+
+static void evict(void)
+{
+  volatile uint8_t* p = evict_buf;
+  size_t i;
+
+  for(i = 0; i < evict_bytes; i += 64)
+  {
+    p[i] += 1;
+  }
+}
+
+static void ecb_encrypt(uint8_t* out, const uint8_t* in, size_t len)
+{
+  if(with_key_setup)
+  {
+    AES128_ECB_encrypt(in, key, out);
+  }
+  else
+  {
+    AES128_ECB_encrypt_keyed(in, &ctx, out);
+  }
+}
+
+static void ecb_decrypt(uint8_t* out, const uint8_t* in, size_t len)
+{
+  if(with_key_setup)
+  {
+    AES128_ECB_decrypt(in, key, out);
+  }
+  else
+  {
+    AES128_ECB_decrypt_keyed(in, &ctx, out);
+  }
+}
+
+static void ecb_decrypt_dkey(uint8_t* out, const uint8_t* in, size_t len)
+{
+  if(with_key_setup)
+  {
+    AES128_expand_dkey(&dctx, key);
+  }
+  AES128_ECB_decrypt_dkey(in, &dctx, out);
+}
+
+static void cbc_encrypt(uint8_t* out, const uint8_t* in, size_t len)
+{
+  AES128_packet_t packet = { in, out, (uint32_t)len, iv, &ctx };
+
+  if(with_key_setup)
+  {
+    AES128_CBC_encrypt_buffer(out, (uint8_t*)in, (uint32_t)len, key, iv);
+  }
+  else
+  {
+    AES128_CBC_encrypt_keyed_packets(&packet, 1);
+  }
+}
+
+static void cbc_decrypt(uint8_t* out, const uint8_t* in, size_t len)
+{
+  AES128_packet_t packet = { in, out, (uint32_t)len, iv, &ctx };
+
+  if(with_key_setup)
+  {
+    AES128_CBC_decrypt_buffer(out, (uint8_t*)in, (uint32_t)len, key, iv);
+  }
+  else
+  {
+    AES128_CBC_decrypt_keyed_packets(&packet, 1);
+  }
+}
+
+static void measure(const struct lat_case* c, int cold, long calls, struct histogram* h)
+{
+  static uint8_t in[MAX_MESSAGE], out[MAX_MESSAGE];
+  uint64_t t;
+  long i;
+
+  memset(h, 0, sizeof(*h));
+  memset(in, 0x5a, sizeof(in));
+  for(i = 0; i < calls; ++i)
+  {
+    if(cold)
+    {
+      evict();
+    }
+    t = timestamp();
+    c->fn(out, in, c->len);
+    record(h, timestamp() - t);
+  }
+}
+
+
+/*****************************************************************************/
+/* Public functions:                                                         */
+/*****************************************************************************/
+int main(int argc, char* argv[])
+{
+  const struct lat_case cases[] =
+  {
+    { "ecb-enc",      16,   ecb_encrypt },
+    { "ecb-dec",      16,   ecb_decrypt },
+    { "ecb-dec-dkey", 16,   ecb_decrypt_dkey },
+    { "cbc-enc",      64,   cbc_encrypt },
+    { "cbc-enc",      256,  cbc_encrypt },
+    { "cbc-enc",      1024, cbc_encrypt },
+    { "cbc-dec",      64,   cbc_decrypt },
+    { "cbc-dec",      256,  cbc_decrypt },
+    { "cbc-dec",      1024, cbc_decrypt },
+  };
+  static struct histogram h;
+  long calls[2] = { 100000, 2000 };
+  unsigned i;
+  int cold, c;
+
+  while((c = getopt(argc, argv, "n:N:e:k")) != -1)
+  {
+    switch(c)
+    {
+      case 'n': calls[0] = atol(optarg); break;
+      case 'N': calls[1] = atol(optarg); break;
+      case 'e': evict_bytes = (size_t)strtoull(optarg, NULL, 0); break;
+      case 'k': with_key_setup = 1; break;
+      default: usage();
+    }
+  }
+  if(calls[0] < 1 || calls[1] < 1)
+  {
+    usage();
+  }
+  if((evict_buf = calloc(1, evict_bytes + 1)) == NULL)
+  {
+    perror("latbench");
+    return 1;
+  }
+  AES128_expand_key(&ctx, key);
+  AES128_expand_dkey(&dctx, key);
+
+  printf("%s per call%s\n", HAVE_CYCLES ? "cycles" : "ns", with_key_setup ? ", key setup included" : "");
+  printf("%-13s %5s %5s %10s %10s %10s %10s %10s\n", "mode", "bytes", "cache", "p50", "p90", "p99", "p99.9", "max");
+  for(i = 0; i < sizeof(cases) / sizeof(cases[0]); ++i)
+  {
+    for(cold = 0; cold < 2; ++cold)
+    {
+      measure(&cases[i], cold, calls[cold], &h);
+      printf("%-13s %5zu %5s %10llu %10llu %10llu %10llu %10llu\n", cases[i].mode, cases[i].len, cold ? "cold" : "warm",
+             (unsigned long long)percentile(&h, 0.5), (unsigned long long)percentile(&h, 0.9),
+             (unsigned long long)percentile(&h, 0.99), (unsigned long long)percentile(&h, 0.999),
+             (unsigned long long)h.max);
+      fflush(stdout);
+    }
+  }
+
+  free(evict_buf);
+  return 0;
+}
@@ -0,0 +1,335 @@
+/*
+
+leakbench - tests whether the time an AES128 engine takes depends on the data.
+
+  leakbench [-n MEASUREMENTS] [-m MODE]
+
+  -n MEASUREMENTS  timed calls per engine and mode (default 1000000)
+  -m MODE          only test this mode, e.g. ecb-dec
+
+The method is dudect's (Reparaz, Balasch, Verbauwhede: "Dude, is my code constant
+time?", 2017). Every call gets either a fixed input block or a random one, picked at
+random, and is timed. Welch's t-test then compares the times of the two classes, on
+all measurements and again with everything above the 50th to 99th percentile cropped,
+since the interesting differences often hide under interrupts and other noise in the
+tail. The largest |t| of these tests is reported:
+
+  below 4.5        no leak detected with this many measurements
+  4.5 and above    the timing depends on the data
+
+More measurements find smaller differences, a clean result only holds for the host and
+the number of measurements it was obtained with. The key is the same for all calls and
+expanded once beforehand, so what is tested is the dependency on the processed data.
+
+*/
+
+
+/*****************************************************************************/
+/* Includes:                                                                 */
+/*****************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "aes.h"
+#include "afalg.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+  #include <x86intrin.h>
+  #define HAVE_CYCLES 1
+#else
+  #define HAVE_CYCLES 0
+#endif
+
+
+/*****************************************************************************/
+/* Defines:                                                                  */
+/*****************************************************************************/
+// |t| from which a difference between the classes counts as a leak, as in dudect.
+#define T_THRESHOLD 4.5
+
+// Measurements before these percentiles are kept in the cropped tests, 100 is no crop.
+#define CROPS 6
+
+
+/*****************************************************************************/
+/* Private variables:                                                        */
+/*****************************************************************************/
+static const uint8_t key[16] = { 0x2b, 0x7e, 0x15, 0x16, 0x28, 0xae, 0xd2, 0xa6, 0xab, 0xf7, 0x15, 0x88, 0x09, 0xcf, 0x4f, 0x3c };
+static const uint8_t iv[16]  = { 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f };
+static const uint8_t fixed[16] = { 0 };
+
+static const double crop_percentile[CROPS] = { 100, 99, 95, 90, 75, 50 };
+
+// One engine and mode, processing the 16 byte block in to out.
+struct leak_case
+{
+  const char* engine;
+  const char* mode;
+  void (*fn)(uint8_t* out, const uint8_t* in);
+};
+
+// Welch's t-test, updated one measurement at a time.
+struct welch
+{
+  double n[2];
+  double mean[2];
+  double m2[2];
+};
+
+static AES128_key_t ctx;
+static AES128_dkey_t dctx;
+static afalg_t kernel_ecb;
+
+static uint64_t rng_state = 0x9e3779b97f4a7c15u;
+
+
+/*****************************************************************************/
+/* Private functions:                                                        */
+/*****************************************************************************/
+static void usage(void)
+{
+  fprintf(stderr, "usage: leakbench [-n MEASUREMENTS] [-m MODE]\n");
+  exit(2);
+}
+
+static uint64_t timestamp(void)
+{
+#if HAVE_CYCLES
+  return __rdtsc();
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+#endif
+}
+
+// xorshift64*, plenty for picking classes and inputs.
+static uint64_t random64(void)
+{
+  rng_state ^= rng_state >> 12;
+  rng_state ^= rng_state << 25;
+  rng_state ^= rng_state >> 27;
+  return rng_state * 0x2545f4914f6cdd1du;
+}
+
+static void ecb_encrypt(uint8_t* out, const uint8_t* in)
+{
+  AES128_ECB_encrypt_keyed(in, &ctx, out);
+}
+
+static void ecb_decrypt(uint8_t* out, const uint8_t* in)
+{
+  AES128_ECB_decrypt_keyed(in, &ctx, out);
+}
+
+static void ecb_decrypt_dkey(uint8_t* out, const uint8_t* in)
+{
+  AES128_ECB_decrypt_dkey(in, &dctx, out);
+}
+
+static void cbc_encrypt_keyed(uint8_t* out, const uint8_t* in)
+{
+  AES128_packet_t packet = { in, out, 16, iv, &ctx };
+  AES128_CBC_encrypt_keyed_packets(&packet, 1);
+}
+
+static void cbc_decrypt_keyed(uint8_t* out, const uint8_t* in)
+{
+  AES128_packet_t packet = { in, out, 16, iv, &ctx };
+  AES128_CBC_decrypt_keyed_packets(&packet, 1);
+}
+
+static void kernel_ecb_encrypt(uint8_t* out, const uint8_t* in)
+{
+  afalg_crypt(&kernel_ecb, 0, out, in, 16, 0);
+}
+
+static void welch_add(struct welch* w, int cls, double x)
+{
+  double d;
+
+  w->n[cls] += 1;
+  d = x - w->mean[cls];
+  w->mean[cls] += d / w->n[cls];
+  w->m2[cls] += d * (x - w->mean[cls]);
+}
+
+static double welch_t(const struct welch* w)
+{
+  double v0, v1;
+
+  if(w->n[0] < 2 || w->n[1] < 2)
+  {
+    return 0;
+  }
+  v0 = w->m2[0] / (w->n[0] - 1);
+  v1 = w->m2[1] / (w->n[1] - 1);
+  if(v0 + v1 == 0)
+  {
+    return 0;
+  }
+  return (w->mean[0] - w->mean[1]) / sqrt(v0 / w->n[0] + v1 / w->n[1]);
+}
+
+static int compare(const void* a, const void* b)
+{
+  uint64_t x = *(const uint64_t*)a;
+  uint64_t y = *(const uint64_t*)b;
+  return (x > y) - (x < y);
+}
+
+// Times n calls of c with random classes, and returns the largest |t| of all crops in
+// *max_t and the percentile of the crop it came from in *worst.
+static int measure(const struct leak_case* c, long n, double* max_t, double* worst)
+{
+  uint64_t* times = malloc((size_t)n * sizeof(*times));
+  uint64_t* sorted = malloc((size_t)n * sizeof(*sorted));
+  uint8_t* classes = malloc((size_t)n);
+  uint8_t* inputs = malloc((size_t)n * 16);
+  uint64_t limit[CROPS], t;
+  struct welch w[CROPS];
+  uint8_t out[16];
+  double abs_t;
+  long i;
+  int k;
+
+  if(times == NULL || sorted == NULL || classes == NULL || inputs == NULL)
+  {
+    free(times);
+    free(sorted);
+    free(classes);
+    free(inputs);
+    return -1;
+  }
+
+  // Inputs are prepared up front so that generating them is not part of the timing
+  for(i = 0; i < n; ++i)
+  {
+    classes[i] = (uint8_t)(random64() & 1);
+    for(k = 0; k < 16; k += 8)
+    {
+      t = random64();
+      memcpy(inputs + i * 16 + k, &t, 8);
+    }
+    if(classes[i] == 0)
+    {
+      memcpy(inputs + i * 16, fixed, 16);
+    }
+  }
+
+  for(i = 0; i < n; ++i)
+  {
+    t = timestamp();
+    c->fn(out, inputs + i * 16);
+    times[i] = timestamp() - t;
+  }
+
+  memcpy(sorted, times, (size_t)n * sizeof(*sorted));
+  qsort(sorted, (size_t)n, sizeof(*sorted), compare);
+  memset(w, 0, sizeof(w));
+  for(k = 0; k < CROPS; ++k)
+  {
+    limit[k] = sorted[(long)((n - 1) * crop_percentile[k] / 100)];
+  }
+  for(i = 0; i < n; ++i)
+  {
+    for(k = 0; k < CROPS; ++k)
+    {
+      if(times[i] <= limit[k])
+      {
+        welch_add(&w[k], classes[i], (double)times[i]);
+      }
+    }
+  }
+
+  *max_t = 0;
+  *worst = 100;
+  for(k = 0; k < CROPS; ++k)
+  {
+    abs_t = fabs(welch_t(&w[k]));
+    if(abs_t > *max_t)
+    {
+      *max_t = abs_t;
+      *worst = crop_percentile[k];
+    }
+  }
+
+  free(times);
+  free(sorted);
+  free(classes);
+  free(inputs);
+  return 0;
+}
+
+
+/*****************************************************************************/
+/* Public functions:                                                         */
+/*****************************************************************************/
+int main(int argc, char* argv[])
+{
+  const struct leak_case cases[] =
+  {
+    { "aes.c", "ecb-enc",       ecb_encrypt },
+    { "aes.c", "ecb-dec",       ecb_decrypt },
+    { "aes.c", "ecb-dec-dkey",  ecb_decrypt_dkey },
+    { "aes.c", "cbc-enc-keyed", cbc_encrypt_keyed },
+    { "aes.c", "cbc-dec-keyed", cbc_decrypt_keyed },
+    { "afalg", "ecb-enc",       kernel_ecb_encrypt },
+  };
+  const char* only = NULL;
+  long n = 1000000;
+  double max_t, worst;
+  int have_kernel, leaks = 0, c;
+  unsigned i;
+
+  while((c = getopt(argc, argv, "n:m:")) != -1)
+  {
+    switch(c)
+    {
+      case 'n': n = atol(optarg); break;
+      case 'm': only = optarg; break;
+      default: usage();
+    }
+  }
+  if(n < 100)
+  {
+    usage();
+  }
+  AES128_expand_key(&ctx, key);
+  AES128_expand_dkey(&dctx, key);
+  have_kernel = afalg_open(&kernel_ecb, AFALG_ECB, key) == 0;
+
+  printf("%-6s %-14s %12s %8s %6s  %s\n", "engine", "mode", "measurements", "max |t|", "crop", "verdict");
+  for(i = 0; i < sizeof(cases) / sizeof(cases[0]); ++i)
+  {
+    if(only != NULL && strcmp(cases[i].mode, only) != 0)
+    {
+      continue;
+    }
+    if(strcmp(cases[i].engine, "afalg") == 0 && !have_kernel)
+    {
+      printf("%-6s %-14s %12s   not available on this kernel\n", cases[i].engine, cases[i].mode, "-");
+      continue;
+    }
+    if(measure(&cases[i], n, &max_t, &worst) != 0)
+    {
+      perror("leakbench");
+      return 1;
+    }
+    printf("%-6s %-14s %12ld %8.2f %5.0f%%  %s\n", cases[i].engine, cases[i].mode, n, max_t, worst,
+           (max_t >= T_THRESHOLD) ? "LEAK: timing depends on the data" : "no leak detected");
+    fflush(stdout);
+    leaks += (max_t >= T_THRESHOLD);
+  }
+
+  if(have_kernel)
+  {
+    afalg_close(&kernel_ecb);
+  }
+  return leaks ? 3 : 0;
+}
@@ -0,0 +1,162 @@
+/*
+
+numabench - AES128 throughput by NUMA node of the thread and of its memory.
+
+  numabench [-s BYTES] [-t SECONDS]
+
+  -s BYTES    buffer encrypted per pass (default 1M)
+  -t SECONDS  time spent on every pair of nodes (default 0.5)
+
+For every pair of CPU node and memory node the thread is bound to the CPU node, the
+buffer and the expanded key are allocated on the memory node, and the buffer is CBC
+encrypted in-place until the time is up. The diagonal of the table is node-local
+throughput, everything else is cross-node.
+
+*/
+
+
+/*****************************************************************************/
+/* Includes:                                                                 */
+/*****************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <numa.h>
+
+#include "aes.h"
+
+
+/*****************************************************************************/
+/* Private functions:                                                        */
+/*****************************************************************************/
+static void usage(void)
+{
+  fprintf(stderr, "usage: numabench [-s BYTES] [-t SECONDS]\n");
+  exit(2);
+}
+
+static double now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// Returns MB/s of CBC encryption with the thread on cpu_node and the data on mem_node.
+static double measure(int cpu_node, int mem_node, size_t size, double seconds)
+{
+  static const uint8_t key[16] = { 0x2b, 0x7e, 0x15, 0x16, 0x28, 0xae, 0xd2, 0xa6, 0xab, 0xf7, 0x15, 0x88, 0x09, 0xcf, 0x4f, 0x3c };
+  static const uint8_t iv[16]  = { 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f };
+  AES128_packet_t packet;
+  AES128_key_t* ctx;
+  uint8_t* buf;
+  double t0, t;
+  size_t bytes = 0;
+
+  if(numa_run_on_node(cpu_node) != 0)
+  {
+    return -1;
+  }
+  buf = numa_alloc_onnode(size, mem_node);
+  ctx = numa_alloc_onnode(sizeof(*ctx), mem_node);
+  if(buf == NULL || ctx == NULL)
+  {
+    if(buf != NULL)
+    {
+      numa_free(buf, size);
+    }
+    if(ctx != NULL)
+    {
+      numa_free(ctx, sizeof(*ctx));
+    }
+    return -1;
+  }
+  memset(buf, 0x5a, size);
+  AES128_expand_key(ctx, key);
+
+  packet.input = buf;
+  packet.output = buf;
+  packet.length = (uint32_t)size;
+  packet.iv = iv;
+  packet.key = ctx;
+
+  t0 = now();
+  do
+  {
+    AES128_CBC_encrypt_keyed_packets(&packet, 1);
+    bytes += size;
+    t = now() - t0;
+  } while(t < seconds);
+
+  numa_free(ctx, sizeof(*ctx));
+  numa_free(buf, size);
+  return bytes / t / 1e6;
+}
+
+
+/*****************************************************************************/
+/* Public functions:                                                         */
+/*****************************************************************************/
+int main(int argc, char* argv[])
+{
+  size_t size = 1024 * 1024;
+  double seconds = 0.5, mbs;
+  int nodes, cpu_node, mem_node, c;
+
+  while((c = getopt(argc, argv, "s:t:")) != -1)
+  {
+    switch(c)
+    {
+      case 's': size = (size_t)strtoul(optarg, NULL, 0); break;
+      case 't': seconds = atof(optarg); break;
+      default: usage();
+    }
+  }
+  size -= size % 16;
+  if(size == 0 || seconds <= 0)
+  {
+    usage();
+  }
+  if(numa_available() < 0)
+  {
+    fprintf(stderr, "numabench: NUMA is not available on this system\n");
+    return 1;
+  }
+
+  nodes = numa_max_node() + 1;
+  printf("MB/s, rows: CPU node, columns: memory node\n");
+  printf("%8s", "");
+  for(mem_node = 0; mem_node < nodes; ++mem_node)
+  {
+    printf("%10d", mem_node);
+  }
+  printf("\n");
+
+  for(cpu_node = 0; cpu_node < nodes; ++cpu_node)
+  {
+    printf("%8d", cpu_node);
+    for(mem_node = 0; mem_node < nodes; ++mem_node)
+    {
+      // Nodes without CPUs or without memory show up as "-"
+      mbs = -1;
+      if(numa_bitmask_isbitset(numa_all_nodes_ptr, (unsigned)mem_node))
+      {
+        mbs = measure(cpu_node, mem_node, size, seconds);
+      }
+      if(mbs < 0)
+      {
+        printf("%10s", "-");
+      }
+      else
+      {
+        printf("%10.2f", mbs);
+      }
+      fflush(stdout);
+    }
+    printf("\n");
+  }
+  return 0;
+}
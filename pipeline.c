@@ -0,0 +1,353 @@
+/*
+
+Bounded-memory read -> transform -> write pipeline, see pipeline.h.
+
+The ring holds PIPELINE_SLOTS buffers. Each slot moves through the states
+FREE -> READ -> DONE -> FREE, the reader, transform and writer threads each walk
+the ring in order and wait on the state they need.
+
+Built with PIPELINE_NUMA (and linked with -lnuma), the pipeline stays on the NUMA
+node of the calling thread: all three threads are bound to that node and the slots
+are allocated from its memory, so no stage touches a buffer on a remote node.
+
+*/
+
+
+/*****************************************************************************/
+/* Includes:                                                                 */
+/*****************************************************************************/
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "pipeline.h"
+
+#ifdef PIPELINE_NUMA
+  #include <sched.h>
+  #include <numa.h>
+#endif
+
+
+/*****************************************************************************/
+/* Private variables:                                                        */
+/*****************************************************************************/
+enum { SLOT_FREE, SLOT_READ, SLOT_DONE };
+
+struct slot
+{
+  uint8_t* buf;
+  size_t len;
+  int last;
+  int state;
+};
+
+struct pipeline
+{
+  struct slot slots[PIPELINE_SLOTS];
+  size_t slot_size;
+  int infd;
+  int outfd;
+  pipeline_fn fn;
+  void* arg;
+  int failed;
+  int node;              // NUMA node of the threads and slots, -1 for no placement
+  pthread_mutex_t lock;
+  pthread_cond_t changed;
+};
+
+
+/*****************************************************************************/
+/* Private functions:                                                        */
+/*****************************************************************************/
+#ifdef PIPELINE_NUMA
+
+static int local_node(void)
+{
+  int cpu;
+
+  if(numa_available() < 0 || (cpu = sched_getcpu()) < 0)
+  {
+    return -1;
+  }
+  return numa_node_of_cpu(cpu);
+}
+
+static void* slot_alloc(struct pipeline* p, size_t len)
+{
+  return (p->node >= 0) ? numa_alloc_onnode(len, p->node) : malloc(len);
+}
+
+static void slot_free(struct pipeline* p, void* buf, size_t len)
+{
+  if(p->node >= 0)
+  {
+    numa_free(buf, len);
+  }
+  else
+  {
+    free(buf);
+  }
+}
+
+// Binds the calling stage thread to the node of the pipeline.
+static void bind_stage(struct pipeline* p)
+{
+  if(p->node >= 0)
+  {
+    numa_run_on_node(p->node);
+  }
+}
+
+#else
+
+static int local_node(void)
+{
+  return -1;
+}
+
+static void* slot_alloc(struct pipeline* p, size_t len)
+{
+  return malloc(len);
+}
+
+static void slot_free(struct pipeline* p, void* buf, size_t len)
+{
+  free(buf);
+}
+
+static void bind_stage(struct pipeline* p)
+{
+}
+
+#endif
+
+
+// Waits until slot i is in the given state, returns 0 if the pipeline failed meanwhile.
+static int wait_slot(struct pipeline* p, unsigned i, int state)
+{
+  int ok;
+  pthread_mutex_lock(&p->lock);
+  while(!p->failed && p->slots[i].state != state)
+  {
+    pthread_cond_wait(&p->changed, &p->lock);
+  }
+  ok = !p->failed;
+  pthread_mutex_unlock(&p->lock);
+  return ok;
+}
+
+static void set_slot(struct pipeline* p, unsigned i, int state)
+{
+  pthread_mutex_lock(&p->lock);
+  p->slots[i].state = state;
+  pthread_cond_broadcast(&p->changed);
+  pthread_mutex_unlock(&p->lock);
+}
+
+static void fail(struct pipeline* p)
+{
+  pthread_mutex_lock(&p->lock);
+  p->failed = 1;
+  pthread_cond_broadcast(&p->changed);
+  pthread_mutex_unlock(&p->lock);
+}
+
+static void* reader(void* arg)
+{
+  struct pipeline* p = arg;
+  unsigned i = 0;
+  ssize_t n;
+  int last;
+  struct slot* s;
+
+  bind_stage(p);
+
+  for(;;)
+  {
+    if(!wait_slot(p, i, SLOT_FREE))
+    {
+      return NULL;
+    }
+    s = &p->slots[i];
+
+    // Fill the slot completely, so only the last chunk can be short.
+    s->len = 0;
+    s->last = 0;
+    while(s->len < p->slot_size)
+    {
+      n = read(p->infd, s->buf + s->len, p->slot_size - s->len);
+      if(n < 0 && errno == EINTR)
+      {
+        continue;
+      }
+      if(n < 0)
+      {
+        fail(p);
+        return NULL;
+      }
+      if(n == 0)
+      {
+        s->last = 1;
+        break;
+      }
+      s->len += (size_t)n;
+    }
+
+    // Once handed on, the slot may be recycled by the other stages - test last before that.
+    last = s->last;
+    set_slot(p, i, SLOT_READ);
+    if(last)
+    {
+      return NULL;
+    }
+    i = (i + 1) % PIPELINE_SLOTS;
+  }
+}
+
+static void* transform(void* arg)
+{
+  struct pipeline* p = arg;
+  unsigned i = 0;
+  size_t n;
+  int last;
+  struct slot* s;
+
+  bind_stage(p);
+
+  for(;;)
+  {
+    if(!wait_slot(p, i, SLOT_READ))
+    {
+      return NULL;
+    }
+    s = &p->slots[i];
+
+    n = p->fn(p->arg, s->buf, s->len, s->last);
+    if(n == (size_t)-1)
+    {
+      fail(p);
+      return NULL;
+    }
+    s->len = n;
+
+    last = s->last;
+    set_slot(p, i, SLOT_DONE);
+    if(last)
+    {
+      return NULL;
+    }
+    i = (i + 1) % PIPELINE_SLOTS;
+  }
+}
+
+static void* writer(void* arg)
+{
+  struct pipeline* p = arg;
+  unsigned i = 0;
+  size_t done;
+  ssize_t n;
+  struct slot* s;
+
+  bind_stage(p);
+
+  for(;;)
+  {
+    if(!wait_slot(p, i, SLOT_DONE))
+    {
+      return NULL;
+    }
+    s = &p->slots[i];
+
+    for(done = 0; done < s->len; done += (size_t)n)
+    {
+      n = write(p->outfd, s->buf + done, s->len - done);
+      if(n < 0 && errno == EINTR)
+      {
+        n = 0;
+        continue;
+      }
+      if(n < 0)
+      {
+        fail(p);
+        return NULL;
+      }
+    }
+
+    if(s->last)
+    {
+      return NULL;
+    }
+    set_slot(p, i, SLOT_FREE);
+    i = (i + 1) % PIPELINE_SLOTS;
+  }
+}
+
+
+/*****************************************************************************/
+/* Public functions:                                                         */
+/*****************************************************************************/
+int pipeline_run(int infd, int outfd, size_t memory, pipeline_fn fn, void* arg)
+{
+  struct pipeline p;
+  void* (*stages[3])(void*) = { reader, transform, writer };
+  pthread_t threads[3];
+  unsigned i, n;
+  int rc;
+
+  memset(&p, 0, sizeof(p));
+  p.infd = infd;
+  p.outfd = outfd;
+  p.fn = fn;
+  p.arg = arg;
+  p.node = local_node();
+
+  // Split the budget over the slots in whole blocks, the slack comes out of it as well.
+  p.slot_size = memory / PIPELINE_SLOTS;
+  p.slot_size = (p.slot_size > PIPELINE_SLACK) ? p.slot_size - PIPELINE_SLACK : 0;
+  p.slot_size -= p.slot_size % 16;
+  if(p.slot_size == 0)
+  {
+    p.slot_size = 16;
+  }
+
+  for(i = 0; i < PIPELINE_SLOTS; ++i)
+  {
+    p.slots[i].buf = slot_alloc(&p, p.slot_size + PIPELINE_SLACK);
+    if(p.slots[i].buf == NULL)
+    {
+      while(i--)
+      {
+        slot_free(&p, p.slots[i].buf, p.slot_size + PIPELINE_SLACK);
+      }
+      return -1;
+    }
+  }
+  pthread_mutex_init(&p.lock, NULL);
+  pthread_cond_init(&p.changed, NULL);
+
+  for(n = 0; n < 3; ++n)
+  {
+    if(pthread_create(&threads[n], NULL, stages[n], &p) != 0)
+    {
+      fail(&p);
+      break;
+    }
+  }
+  for(i = 0; i < n; ++i)
+  {
+    pthread_join(threads[i], NULL);
+  }
+  rc = p.failed ? -1 : 0;
+
+  pthread_cond_destroy(&p.changed);
+  pthread_mutex_destroy(&p.lock);
+  for(i = 0; i < PIPELINE_SLOTS; ++i)
+  {
+    slot_free(&p, p.slots[i].buf, p.slot_size + PIPELINE_SLACK);
+  }
+  return rc;
+}
@@ -0,0 +1,31 @@
+#ifndef _PIPELINE_H_
+#define _PIPELINE_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+
+// A bounded-memory read -> transform -> write pipeline.
+//
+// The three stages run in their own threads and pass buffers around a fixed ring of
+// PIPELINE_SLOTS slots, so peak memory is set by the caller regardless of the stream
+// length, and throughput is limited by the slowest stage instead of the sum of all three.
+
+#ifndef PIPELINE_SLOTS
+  #define PIPELINE_SLOTS 4
+#endif
+
+// Every slot has room for this many bytes beyond the data read into it, e.g. for padding.
+#define PIPELINE_SLACK 16
+
+// Transforms len bytes of buf in-place and returns the number of bytes to write.
+// Every chunk but the last (last != 0) is a multiple of 16 bytes long. Returning
+// (size_t)-1 aborts the pipeline.
+typedef size_t (*pipeline_fn)(void* arg, uint8_t* buf, size_t len, int last);
+
+// Runs the pipeline from infd to outfd until end of input, using about memory bytes of buffers.
+// Returns 0 on success and -1 on a read, write or transform error.
+int pipeline_run(int infd, int outfd, size_t memory, pipeline_fn fn, void* arg);
+
+
+#endif //_PIPELINE_H_
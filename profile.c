@@ -0,0 +1,162 @@
+/*
+
+profile - measures one footprint profile for `make profiles`.
+
+  profile NAME TEXT DATA BSS
+
+Prints one row of the profile table: the name and section sizes given on the command
+line (from `size aes.o`), the stack high-water mark of a decryption and of a CBC
+encryption, and cycles per byte of ECB and CBC encryption. Columns that do not apply
+to the profile, or cannot be measured on the host, show "-".
+
+*/
+
+
+/*****************************************************************************/
+/* Includes:                                                                 */
+/*****************************************************************************/
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "aes.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+  #include <x86intrin.h>
+  #define HAVE_CYCLES 1
+#else
+  #define HAVE_CYCLES 0
+#endif
+
+
+/*****************************************************************************/
+/* Defines:                                                                  */
+/*****************************************************************************/
+// Stack below the caller that is painted to find the high-water mark.
+#define STACK_PROBE 4096
+#define STACK_PAINT 0xa5
+
+// Bytes encrypted per timing run, and runs of which the fastest is reported.
+#define BENCH_BYTES 4096
+#define BENCH_RUNS  20
+
+
+/*****************************************************************************/
+/* Private variables:                                                        */
+/*****************************************************************************/
+static const uint8_t key[16] = { 0x2b, 0x7e, 0x15, 0x16, 0x28, 0xae, 0xd2, 0xa6, 0xab, 0xf7, 0x15, 0x88, 0x09, 0xcf, 0x4f, 0x3c };
+#if defined(CBC) && CBC
+static const uint8_t iv[16]  = { 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f };
+#endif
+
+static uint8_t in[BENCH_BYTES];
+static uint8_t out[BENCH_BYTES];
+
+static uintptr_t probe_at;   // painted stack area, see paint()
+
+
+/*****************************************************************************/
+/* Private functions:                                                        */
+/*****************************************************************************/
+
+// Paints the stack below the caller and remembers where, so the depth reached by the
+// next call from the same frame can be read back afterwards.
+static void __attribute__((noinline)) paint(void)
+{
+  volatile uint8_t probe[STACK_PROBE];
+  unsigned i;
+
+  for(i = 0; i < STACK_PROBE; ++i)
+  {
+    probe[i] = STACK_PAINT;
+  }
+  probe_at = (uintptr_t)probe;
+}
+
+static void ecb_encrypt(void)
+{
+  uint32_t i;
+
+  for(i = 0; i < BENCH_BYTES; i += 16)
+  {
+    AES128_ECB_encrypt(in + i, key, out + i);
+  }
+}
+
+static void ecb_decrypt(void)
+{
+  AES128_ECB_decrypt(in, key, out);
+}
+
+#if defined(CBC) && CBC
+static void cbc_encrypt(void)
+{
+  AES128_CBC_encrypt_buffer(out, in, BENCH_BYTES, key, iv);
+}
+#endif
+
+static unsigned stack_use(void (*fn)(void))
+{
+  const volatile uint8_t* probe;
+  unsigned i;
+
+  paint();
+  fn();
+
+  // The stack grows down, the used part is at the top of the painted area
+  probe = (const volatile uint8_t*)probe_at;
+  for(i = 0; i < STACK_PROBE && probe[i] == STACK_PAINT; ++i)
+  {
+  }
+  return STACK_PROBE - i;
+}
+
+static void print_cycles(void (*fn)(void))
+{
+#if HAVE_CYCLES
+  uint64_t t, best = UINT64_MAX;
+  int run;
+
+  for(run = 0; run < BENCH_RUNS; ++run)
+  {
+    t = __rdtsc();
+    fn();
+    t = __rdtsc() - t;
+    best = (t < best) ? t : best;
+  }
+  printf(" %9.1f", (double)best / BENCH_BYTES);
+#else
+  printf(" %9s", "-");
+#endif
+}
+
+
+/*****************************************************************************/
+/* Public functions:                                                         */
+/*****************************************************************************/
+int main(int argc, char* argv[])
+{
+  if(argc != 5)
+  {
+    fprintf(stderr, "usage: profile NAME TEXT DATA BSS\n");
+    return 2;
+  }
+  memset(in, 0x5a, sizeof(in));
+
+  printf("%-8s %7s %7s %7s", argv[1], argv[2], argv[3], argv[4]);
+  printf(" %7u", stack_use(ecb_decrypt));
+#if defined(CBC) && CBC
+  printf(" %7u", stack_use(cbc_encrypt));
+#else
+  printf(" %7s", "-");
+#endif
+
+  print_cycles(ecb_encrypt);
+#if defined(CBC) && CBC
+  print_cycles(cbc_encrypt);
+#else
+  printf(" %9s", "-");
+#endif
+  printf("\n");
+  return 0;
+}
@@ -0,0 +1,311 @@
+/*
+
+scalebench - AES128 throughput as threads are added.
+
+  scalebench [-t THREADS] [-s BYTES] [-d SECONDS]
+
+  -t THREADS  largest number of threads (default: online CPUs)
+  -s BYTES    message processed per call by every thread (default 64K)
+  -d SECONDS  time measured for every case and thread count (default 0.5)
+
+For 1 to THREADS threads, every engine and mode is run on all threads at once, twice:
+
+  private  every thread has its own copy of the key context and its own input buffer
+  shared   all threads use one key context and read one input buffer
+
+Outputs are always private to the thread. The lookup tables of aes.c are shared in
+both runs, the shared run adds the key schedule and the input. Only functions that
+keep no state between calls take part: the keyed CBC packets, ECB decryption with an
+AES128_dkey_t and, when the kernel offers AF_ALG, one kernel handle per thread.
+
+Reported are the aggregate MB/s of all threads, the efficiency (aggregate divided by
+threads times the single thread rate) and shared/private, the throughput of the shared
+run relative to the private one. Efficiency falling off early points at a shared
+resource such as memory bandwidth; shared/private below 100% at contention on the data
+all threads read.
+
+*/
+
+
+/*****************************************************************************/
+/* Includes:                                                                 */
+/*****************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "aes.h"
+#include "afalg.h"
+
+
+/*****************************************************************************/
+/* Defines:                                                                  */
+/*****************************************************************************/
+#define MAX_THREADS 256
+
+
+/*****************************************************************************/
+/* Private variables:                                                        */
+/*****************************************************************************/
+static const uint8_t key[16] = { 0x2b, 0x7e, 0x15, 0x16, 0x28, 0xae, 0xd2, 0xa6, 0xab, 0xf7, 0x15, 0x88, 0x09, 0xcf, 0x4f, 0x3c };
+static const uint8_t iv[16]  = { 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f };
+
+// What one thread works with. key and dkey point at the thread's own copies or at the
+// shared ones, input at its own buffer or at the shared one.
+struct worker
+{
+  pthread_t thread;
+  const AES128_key_t* key;
+  const AES128_dkey_t* dkey;
+  afalg_t kernel;
+  const uint8_t* input;
+  uint8_t* output;
+  AES128_key_t own_key;
+  AES128_dkey_t own_dkey;
+  uint8_t* own_input;
+  double mbs;    // result of the thread
+};
+
+struct scale_case
+{
+  const char* engine;
+  const char* mode;
+  int (*fn)(struct worker* w, size_t len);
+};
+
+static const struct scale_case* current;   // the case measure() runs
+static pthread_barrier_t start;
+static size_t size = 64 * 1024;
+static double seconds = 0.5;
+
+
+/*****************************************************************************/
+/* Private functions:                                                        */
+/*****************************************************************************/
+static void usage(void)
+{
+  fprintf(stderr, "usage: scalebench [-t THREADS] [-s BYTES] [-d SECONDS]\n");
+  exit(2);
+}
+
+static double now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static int cbc_encrypt_keyed(struct worker* w, size_t len)
+{
+  AES128_packet_t packet = { w->input, w->output, (uint32_t)len, iv, w->key };
+  AES128_CBC_encrypt_keyed_packets(&packet, 1);
+  return 0;
+}
+
+static int cbc_decrypt_keyed(struct worker* w, size_t len)
+{
+  AES128_packet_t packet = { w->input, w->output, (uint32_t)len, iv, w->key };
+  AES128_CBC_decrypt_keyed_packets(&packet, 1);
+  return 0;
+}
+
+static int ecb_decrypt_dkey(struct worker* w, size_t len)
+{
+  size_t i;
+  for(i = 0; i < len; i += 16)
+  {
+    AES128_ECB_decrypt_dkey(w->input + i, w->dkey, w->output + i);
+  }
+  return 0;
+}
+
+static int kernel_cbc_encrypt(struct worker* w, size_t len)
+{
+  uint8_t chain[16];
+  memcpy(chain, iv, sizeof(chain));
+  return afalg_crypt(&w->kernel, 0, w->output, w->input, len, chain);
+}
+
+static void* run(void* arg)
+{
+  struct worker* w = arg;
+  size_t bytes = 0;
+  double t0, t;
+
+  pthread_barrier_wait(&start);
+  t0 = now();
+  do
+  {
+    if(current->fn(w, size) != 0)
+    {
+      w->mbs = -1;
+      return NULL;
+    }
+    bytes += size;
+    t = now() - t0;
+  } while(t < seconds);
+  w->mbs = bytes / t / 1e6;
+  return NULL;
+}
+
+// Runs current on threads workers at once. Returns the aggregate MB/s, or -1.
+static double measure(struct worker* workers, int threads)
+{
+  double total = 0;
+  int i;
+
+  pthread_barrier_init(&start, NULL, (unsigned)threads);
+  for(i = 1; i < threads; ++i)
+  {
+    pthread_create(&workers[i].thread, NULL, run, &workers[i]);
+  }
+  run(&workers[0]);
+  for(i = 1; i < threads; ++i)
+  {
+    pthread_join(workers[i].thread, NULL);
+  }
+  pthread_barrier_destroy(&start);
+
+  for(i = 0; i < threads; ++i)
+  {
+    if(workers[i].mbs < 0)
+    {
+      return -1;
+    }
+    total += workers[i].mbs;
+  }
+  return total;
+}
+
+// Points the first threads workers at their own or at the shared key and input.
+static void share(struct worker* workers, int threads, int shared, const AES128_key_t* key_ctx,
+                  const AES128_dkey_t* dkey_ctx, const uint8_t* input)
+{
+  int i;
+  for(i = 0; i < threads; ++i)
+  {
+    workers[i].key = shared ? key_ctx : &workers[i].own_key;
+    workers[i].dkey = shared ? dkey_ctx : &workers[i].own_dkey;
+    workers[i].input = shared ? input : workers[i].own_input;
+  }
+}
+
+
+/*****************************************************************************/
+/* Public functions:                                                         */
+/*****************************************************************************/
+int main(int argc, char* argv[])
+{
+  const struct scale_case cases[] =
+  {
+    { "aes.c", "cbc-enc-keyed", cbc_encrypt_keyed },
+    { "aes.c", "cbc-dec-keyed", cbc_decrypt_keyed },
+    { "aes.c", "ecb-dec-dkey",  ecb_decrypt_dkey },
+    { "afalg", "cbc-enc",       kernel_cbc_encrypt },
+  };
+  static struct worker workers[MAX_THREADS];
+  AES128_key_t* key_ctx;
+  AES128_dkey_t dkey_ctx;
+  uint8_t* input;
+  double private_mbs, shared_mbs, single = 0;
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  int max_threads = (cpus > 0) ? (int)cpus : 1;
+  int have_kernel = 1, threads, i, c;
+  unsigned k;
+
+  while((c = getopt(argc, argv, "t:s:d:")) != -1)
+  {
+    switch(c)
+    {
+      case 't': max_threads = atoi(optarg); break;
+      case 's': size = (size_t)strtoul(optarg, NULL, 0); break;
+      case 'd': seconds = atof(optarg); break;
+      default: usage();
+    }
+  }
+  size -= size % 16;
+  if(size == 0 || seconds <= 0 || max_threads < 1 || max_threads > MAX_THREADS)
+  {
+    usage();
+  }
+
+  if(posix_memalign((void**)&key_ctx, AES128_KEY_ALIGN, sizeof(*key_ctx)) != 0 || posix_memalign((void**)&input, AES128_KEY_ALIGN, size) != 0)
+  {
+    perror("scalebench");
+    return 1;
+  }
+  memset(input, 0x5a, size);
+  AES128_expand_key(key_ctx, key);
+  AES128_expand_dkey(&dkey_ctx, key);
+
+  for(i = 0; i < max_threads; ++i)
+  {
+    if(posix_memalign((void**)&workers[i].own_input, AES128_KEY_ALIGN, size) != 0
+      || posix_memalign((void**)&workers[i].output, AES128_KEY_ALIGN, size) != 0)
+    {
+      perror("scalebench");
+      return 1;
+    }
+    memset(workers[i].own_input, 0x5a, size);
+    AES128_expand_key(&workers[i].own_key, key);
+    AES128_expand_dkey(&workers[i].own_dkey, key);
+  }
+  for(i = 0; have_kernel && i < max_threads; ++i)
+  {
+    if(afalg_open(&workers[i].kernel, AFALG_CBC, key) != 0)
+    {
+      while(--i >= 0)
+      {
+        afalg_close(&workers[i].kernel);
+      }
+      have_kernel = 0;
+    }
+  }
+
+  printf("%-6s %-14s %7s %10s %10s %14s\n", "engine", "mode", "threads", "MB/s", "efficiency", "shared/private");
+  for(k = 0; k < sizeof(cases) / sizeof(cases[0]); ++k)
+  {
+    if(strcmp(cases[k].engine, "afalg") == 0 && !have_kernel)
+    {
+      printf("%-6s %-14s %7s   not available on this kernel\n", cases[k].engine, cases[k].mode, "-");
+      continue;
+    }
+    current = &cases[k];
+    for(threads = 1; threads <= max_threads; ++threads)
+    {
+      share(workers, threads, 0, key_ctx, &dkey_ctx, input);
+      private_mbs = measure(workers, threads);
+      share(workers, threads, 1, key_ctx, &dkey_ctx, input);
+      shared_mbs = measure(workers, threads);
+      if(private_mbs <= 0 || shared_mbs <= 0)
+      {
+        printf("%-6s %-14s %7d   failed\n", cases[k].engine, cases[k].mode, threads);
+        break;
+      }
+      if(threads == 1)
+      {
+        single = private_mbs;
+      }
+      printf("%-6s %-14s %7d %10.2f %9.1f%% %13.1f%%\n", cases[k].engine, cases[k].mode, threads, private_mbs,
+             100.0 * private_mbs / (threads * single), 100.0 * shared_mbs / private_mbs);
+      fflush(stdout);
+    }
+  }
+
+  for(i = 0; i < max_threads; ++i)
+  {
+    if(have_kernel)
+    {
+      afalg_close(&workers[i].kernel);
+    }
+    free(workers[i].own_input);
+    free(workers[i].output);
+  }
+  free(key_ctx);
+  free(input);
+  return 0;
+}
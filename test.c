@@ -12,9 +12,19 @@
 static void phex(uint8_t* str);
 static void test_encrypt_ecb(void);
 static void test_decrypt_ecb(void);
+static void test_decrypt_ecb_dkey(void);
+static void test_ecb_keyed(void);
 static void test_encrypt_ecb_verbose(void);
 static void test_encrypt_cbc(void);
 static void test_decrypt_cbc(void);
+static void test_encrypt_cbc_packets(void);
+static void test_decrypt_cbc_packets(void);
+static void test_cbc_keyed_packets(void);
+static void test_expand_keys(void);
+#if AES128_STATS
+static void test_stats(void);
+static void test_stats_prometheus(void);
+#endif
 
 
 
@@ -23,8 +33,18 @@ int main(void)
     test_encrypt_cbc();
     test_decrypt_cbc();
     test_decrypt_ecb();
+    test_decrypt_ecb_dkey();
+    test_ecb_keyed();
     test_encrypt_ecb();
     test_encrypt_ecb_verbose();
+    test_encrypt_cbc_packets();
+    test_decrypt_cbc_packets();
+    test_cbc_keyed_packets();
+    test_expand_keys();
+#if AES128_STATS
+    test_stats();
+    test_stats_prometheus();
+#endif
     
     return 0;
 }
@@ -186,3 +206,329 @@ static void test_decrypt_ecb(void)
 }
 
 
+static void test_decrypt_ecb_dkey(void)
+{
+  // The four ECB vectors, decrypted with only the last round key kept
+  uint8_t key[] = {0x2b, 0x7e, 0x15, 0x16, 0x28, 0xae, 0xd2, 0xa6, 0xab, 0xf7, 0x15, 0x88, 0x09, 0xcf, 0x4f, 0x3c};
+  uint8_t in[]  = {0x3a, 0xd7, 0x7b, 0xb4, 0x0d, 0x7a, 0x36, 0x60, 0xa8, 0x9e, 0xca, 0xf3, 0x24, 0x66, 0xef, 0x97,
+                   0xf5, 0xd3, 0xd5, 0x85, 0x03, 0xb9, 0x69, 0x9d, 0xe7, 0x85, 0x89, 0x5a, 0x96, 0xfd, 0xba, 0xaf,
+                   0x43, 0xb1, 0xcd, 0x7f, 0x59, 0x8e, 0xce, 0x23, 0x88, 0x1b, 0x00, 0xe3, 0xed, 0x03, 0x06, 0x88,
+                   0x7b, 0x0c, 0x78, 0x5e, 0x27, 0xe8, 0xad, 0x3f, 0x82, 0x23, 0x20, 0x71, 0x04, 0x72, 0x5d, 0xd4};
+  uint8_t out[] = {0x6b, 0xc1, 0xbe, 0xe2, 0x2e, 0x40, 0x9f, 0x96, 0xe9, 0x3d, 0x7e, 0x11, 0x73, 0x93, 0x17, 0x2a,
+                   0xae, 0x2d, 0x8a, 0x57, 0x1e, 0x03, 0xac, 0x9c, 0x9e, 0xb7, 0x6f, 0xac, 0x45, 0xaf, 0x8e, 0x51,
+                   0x30, 0xc8, 0x1c, 0x46, 0xa3, 0x5c, 0xe4, 0x11, 0xe5, 0xfb, 0xc1, 0x19, 0x1a, 0x0a, 0x52, 0xef,
+                   0xf6, 0x9f, 0x24, 0x45, 0xdf, 0x4f, 0x9b, 0x17, 0xad, 0x2b, 0x41, 0x7b, 0xe6, 0x6c, 0x37, 0x10};
+  uint8_t buffer[64];
+  AES128_dkey_t dkey;
+  uint8_t i;
+
+  AES128_expand_dkey(&dkey, key);
+  for(i = 0; i < 4; ++i)
+  {
+    AES128_ECB_decrypt_dkey(in + i * 16, &dkey, buffer + i * 16);
+  }
+
+  printf("ECB decrypt with last round key: ");
+
+  if(0 == memcmp((char*) out, (char*) buffer, 64))
+  {
+    printf("SUCCESS!\n");
+  }
+  else
+  {
+    printf("FAILURE!\n");
+  }
+}
+
+
+static void test_ecb_keyed(void)
+{
+  // The four ECB vectors encrypted and decrypted again with one expanded key
+  uint8_t key[]    = {0x2b, 0x7e, 0x15, 0x16, 0x28, 0xae, 0xd2, 0xa6, 0xab, 0xf7, 0x15, 0x88, 0x09, 0xcf, 0x4f, 0x3c};
+  uint8_t plain[]  = {0x6b, 0xc1, 0xbe, 0xe2, 0x2e, 0x40, 0x9f, 0x96, 0xe9, 0x3d, 0x7e, 0x11, 0x73, 0x93, 0x17, 0x2a,
+                      0xae, 0x2d, 0x8a, 0x57, 0x1e, 0x03, 0xac, 0x9c, 0x9e, 0xb7, 0x6f, 0xac, 0x45, 0xaf, 0x8e, 0x51,
+                      0x30, 0xc8, 0x1c, 0x46, 0xa3, 0x5c, 0xe4, 0x11, 0xe5, 0xfb, 0xc1, 0x19, 0x1a, 0x0a, 0x52, 0xef,
+                      0xf6, 0x9f, 0x24, 0x45, 0xdf, 0x4f, 0x9b, 0x17, 0xad, 0x2b, 0x41, 0x7b, 0xe6, 0x6c, 0x37, 0x10};
+  uint8_t cipher[] = {0x3a, 0xd7, 0x7b, 0xb4, 0x0d, 0x7a, 0x36, 0x60, 0xa8, 0x9e, 0xca, 0xf3, 0x24, 0x66, 0xef, 0x97,
+                      0xf5, 0xd3, 0xd5, 0x85, 0x03, 0xb9, 0x69, 0x9d, 0xe7, 0x85, 0x89, 0x5a, 0x96, 0xfd, 0xba, 0xaf,
+                      0x43, 0xb1, 0xcd, 0x7f, 0x59, 0x8e, 0xce, 0x23, 0x88, 0x1b, 0x00, 0xe3, 0xed, 0x03, 0x06, 0x88,
+                      0x7b, 0x0c, 0x78, 0x5e, 0x27, 0xe8, 0xad, 0x3f, 0x82, 0x23, 0x20, 0x71, 0x04, 0x72, 0x5d, 0xd4};
+  uint8_t buffer[64];
+  uint8_t back[64];
+  AES128_key_t ctx;
+  uint8_t i;
+
+  AES128_expand_key(&ctx, key);
+  for(i = 0; i < 4; ++i)
+  {
+    AES128_ECB_encrypt_keyed(plain + i * 16, &ctx, buffer + i * 16);
+    AES128_ECB_decrypt_keyed(buffer + i * 16, &ctx, back + i * 16);
+  }
+
+  printf("ECB keyed: ");
+
+  if(0 == memcmp((char*) cipher, (char*) buffer, 64) && 0 == memcmp((char*) plain, (char*) back, 64))
+  {
+    printf("SUCCESS!\n");
+  }
+  else
+  {
+    printf("FAILURE!\n");
+  }
+}
+
+
+static void test_encrypt_cbc_packets(void)
+{
+  // The four blocks split into two packets: the second one is chained on the last ciphertext block of the first
+
+  uint8_t key[] = { 0x2b, 0x7e, 0x15, 0x16, 0x28, 0xae, 0xd2, 0xa6, 0xab, 0xf7, 0x15, 0x88, 0x09, 0xcf, 0x4f, 0x3c };
+  uint8_t iv[]  = { 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f };
+  uint8_t in[]  = { 0x6b, 0xc1, 0xbe, 0xe2, 0x2e, 0x40, 0x9f, 0x96, 0xe9, 0x3d, 0x7e, 0x11, 0x73, 0x93, 0x17, 0x2a,
+                    0xae, 0x2d, 0x8a, 0x57, 0x1e, 0x03, 0xac, 0x9c, 0x9e, 0xb7, 0x6f, 0xac, 0x45, 0xaf, 0x8e, 0x51,
+                    0x30, 0xc8, 0x1c, 0x46, 0xa3, 0x5c, 0xe4, 0x11, 0xe5, 0xfb, 0xc1, 0x19, 0x1a, 0x0a, 0x52, 0xef,
+                    0xf6, 0x9f, 0x24, 0x45, 0xdf, 0x4f, 0x9b, 0x17, 0xad, 0x2b, 0x41, 0x7b, 0xe6, 0x6c, 0x37, 0x10 };
+  uint8_t out[] = { 0x76, 0x49, 0xab, 0xac, 0x81, 0x19, 0xb2, 0x46, 0xce, 0xe9, 0x8e, 0x9b, 0x12, 0xe9, 0x19, 0x7d,
+                    0x50, 0x86, 0xcb, 0x9b, 0x50, 0x72, 0x19, 0xee, 0x95, 0xdb, 0x11, 0x3a, 0x91, 0x76, 0x78, 0xb2,
+                    0x73, 0xbe, 0xd6, 0xb8, 0xe3, 0xc1, 0x74, 0x3b, 0x71, 0x16, 0xe6, 0x9e, 0x22, 0x22, 0x95, 0x16, 
+                    0x3f, 0xf1, 0xca, 0xa1, 0x68, 0x1f, 0xac, 0x09, 0x12, 0x0e, 0xca, 0x30, 0x75, 0x86, 0xe1, 0xa7 };
+  uint8_t buffer[64];
+  AES128_packet_t packets[2];
+
+  packets[0].input = in;      packets[0].output = buffer;      packets[0].length = 32; packets[0].iv = iv;
+  packets[1].input = in + 32; packets[1].output = buffer + 32; packets[1].length = 32; packets[1].iv = out + 16;
+
+  AES128_CBC_encrypt_packets(packets, 2, key);
+
+  printf("CBC encrypt packets: ");
+
+  if(0 == memcmp((char*) out, (char*) buffer, 64))
+  {
+    printf("SUCCESS!\n");
+  }
+  else
+  {
+    printf("FAILURE!\n");
+  }
+}
+
+static void test_decrypt_cbc_packets(void)
+{
+  // Same split as above, decrypted in-place
+
+  uint8_t key[] = { 0x2b, 0x7e, 0x15, 0x16, 0x28, 0xae, 0xd2, 0xa6, 0xab, 0xf7, 0x15, 0x88, 0x09, 0xcf, 0x4f, 0x3c };
+  uint8_t iv[]  = { 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f };
+  uint8_t in[]  = { 0x76, 0x49, 0xab, 0xac, 0x81, 0x19, 0xb2, 0x46, 0xce, 0xe9, 0x8e, 0x9b, 0x12, 0xe9, 0x19, 0x7d,
+                    0x50, 0x86, 0xcb, 0x9b, 0x50, 0x72, 0x19, 0xee, 0x95, 0xdb, 0x11, 0x3a, 0x91, 0x76, 0x78, 0xb2,
+                    0x73, 0xbe, 0xd6, 0xb8, 0xe3, 0xc1, 0x74, 0x3b, 0x71, 0x16, 0xe6, 0x9e, 0x22, 0x22, 0x95, 0x16, 
+                    0x3f, 0xf1, 0xca, 0xa1, 0x68, 0x1f, 0xac, 0x09, 0x12, 0x0e, 0xca, 0x30, 0x75, 0x86, 0xe1, 0xa7 };
+  uint8_t out[] = { 0x6b, 0xc1, 0xbe, 0xe2, 0x2e, 0x40, 0x9f, 0x96, 0xe9, 0x3d, 0x7e, 0x11, 0x73, 0x93, 0x17, 0x2a,
+                    0xae, 0x2d, 0x8a, 0x57, 0x1e, 0x03, 0xac, 0x9c, 0x9e, 0xb7, 0x6f, 0xac, 0x45, 0xaf, 0x8e, 0x51,
+                    0x30, 0xc8, 0x1c, 0x46, 0xa3, 0x5c, 0xe4, 0x11, 0xe5, 0xfb, 0xc1, 0x19, 0x1a, 0x0a, 0x52, 0xef,
+                    0xf6, 0x9f, 0x24, 0x45, 0xdf, 0x4f, 0x9b, 0x17, 0xad, 0x2b, 0x41, 0x7b, 0xe6, 0x6c, 0x37, 0x10 };
+  uint8_t iv2[16];
+  AES128_packet_t packets[2];
+
+  memcpy(iv2, in + 16, 16);
+  packets[0].input = in;      packets[0].output = in;      packets[0].length = 32; packets[0].iv = iv;
+  packets[1].input = in + 32; packets[1].output = in + 32; packets[1].length = 32; packets[1].iv = iv2;
+
+  AES128_CBC_decrypt_packets(packets, 2, key);
+
+  printf("CBC decrypt packets: ");
+
+  if(0 == memcmp((char*) out, (char*) in, 64))
+  {
+    printf("SUCCESS!\n");
+  }
+  else
+  {
+    printf("FAILURE!\n");
+  }
+}
+
+static void test_cbc_keyed_packets(void)
+{
+  // Two flows with their own keys in one burst: the first packet uses the SP 800-38A key,
+  // the second one is checked against the buffer function, then both are decrypted again
+
+  uint8_t key1[] = { 0x2b, 0x7e, 0x15, 0x16, 0x28, 0xae, 0xd2, 0xa6, 0xab, 0xf7, 0x15, 0x88, 0x09, 0xcf, 0x4f, 0x3c };
+  uint8_t key2[] = { 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f };
+  uint8_t iv[]   = { 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f };
+  uint8_t in[]   = { 0x6b, 0xc1, 0xbe, 0xe2, 0x2e, 0x40, 0x9f, 0x96, 0xe9, 0x3d, 0x7e, 0x11, 0x73, 0x93, 0x17, 0x2a,
+                     0xae, 0x2d, 0x8a, 0x57, 0x1e, 0x03, 0xac, 0x9c, 0x9e, 0xb7, 0x6f, 0xac, 0x45, 0xaf, 0x8e, 0x51 };
+  uint8_t out[]  = { 0x76, 0x49, 0xab, 0xac, 0x81, 0x19, 0xb2, 0x46, 0xce, 0xe9, 0x8e, 0x9b, 0x12, 0xe9, 0x19, 0x7d,
+                     0x50, 0x86, 0xcb, 0x9b, 0x50, 0x72, 0x19, 0xee, 0x95, 0xdb, 0x11, 0x3a, 0x91, 0x76, 0x78, 0xb2 };
+  uint8_t expected[32];
+  uint8_t buffer[64];
+  uint8_t plain[64];
+  AES128_key_t keys[2];
+  AES128_packet_t packets[2];
+  int ok;
+
+  AES128_CBC_encrypt_buffer(expected, in, 32, key2, iv);
+
+  AES128_expand_key(&keys[0], key1);
+  AES128_expand_key(&keys[1], key2);
+
+  packets[0].input = in; packets[0].output = buffer;      packets[0].length = 32; packets[0].iv = iv; packets[0].key = &keys[0];
+  packets[1].input = in; packets[1].output = buffer + 32; packets[1].length = 32; packets[1].iv = iv; packets[1].key = &keys[1];
+
+  AES128_CBC_encrypt_keyed_packets(packets, 2);
+  ok = (0 == memcmp(out, buffer, 32)) && (0 == memcmp(expected, buffer + 32, 32));
+
+  packets[0].input = buffer;      packets[0].output = plain;
+  packets[1].input = buffer + 32; packets[1].output = plain + 32;
+
+  AES128_CBC_decrypt_keyed_packets(packets, 2);
+  ok = ok && (0 == memcmp(in, plain, 32)) && (0 == memcmp(in, plain + 32, 32));
+
+  printf("CBC keyed packets: ");
+
+  if(ok)
+  {
+    printf("SUCCESS!\n");
+  }
+  else
+  {
+    printf("FAILURE!\n");
+  }
+}
+
+static void test_expand_keys(void)
+{
+  // The batched key expansion must give the same round keys as the single one, also for a partial batch
+
+  uint8_t keys[5 * 16];
+  AES128_key_t single[5];
+  AES128_key_t batch[5];
+  uint8_t i;
+
+  for(i = 0; i < sizeof(keys); ++i)
+  {
+    keys[i] = (uint8_t)(i * 37 + 11);
+  }
+  // Clear the padding after RoundKey, so whole contexts can be compared
+  memset(single, 0, sizeof(single));
+  memset(batch, 0, sizeof(batch));
+  for(i = 0; i < 5; ++i)
+  {
+    AES128_expand_key(&single[i], keys + i * 16);
+  }
+  AES128_expand_keys(batch, keys, 5);
+
+  printf("Key expansion batch: ");
+
+  if(0 == memcmp((char*) single, (char*) batch, sizeof(single)))
+  {
+    printf("SUCCESS!\n");
+  }
+  else
+  {
+    printf("FAILURE!\n");
+  }
+}
+
+#if AES128_STATS
+
+static void test_stats(void)
+{
+  // Known calls add known amounts between two snapshots, a flow counts the same while it is set
+
+  uint8_t key[] = { 0x2b, 0x7e, 0x15, 0x16, 0x28, 0xae, 0xd2, 0xa6, 0xab, 0xf7, 0x15, 0x88, 0x09, 0xcf, 0x4f, 0x3c };
+  uint8_t iv[]  = { 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f };
+  uint8_t in[48];
+  uint8_t out[64];
+  AES128_key_t ctx;
+  AES128_packet_t packets[2];
+  AES128_stats_t before, after, flow, delta;
+  uint8_t i;
+  int ok;
+
+  memset(in, 0x5a, sizeof(in));
+  memset(&flow, 0, sizeof(flow));
+  AES128_expand_key(&ctx, key);
+  packets[0].input = in; packets[0].output = out;      packets[0].length = 32; packets[0].iv = iv; packets[0].key = &ctx;
+  packets[1].input = in; packets[1].output = out + 32; packets[1].length = 20; packets[1].iv = iv; packets[1].key = &ctx;
+
+  AES128_stats_snapshot(&before);
+  AES128_stats_flow(&flow);
+
+  AES128_ECB_encrypt(in, key, out);
+  AES128_ECB_decrypt(in, key, out);
+  AES128_CBC_encrypt_buffer(out, in, 48, key, iv);
+  AES128_CBC_encrypt_keyed_packets(packets, 2);
+
+  AES128_stats_flow(0);
+  AES128_stats_snapshot(&after);
+
+  // Not counted into the flow any more
+  AES128_ECB_encrypt(in, key, out);
+
+  ok = 1;
+  for(i = 0; i < AES128_STATS_COUNT; ++i)
+  {
+    delta.counter[i] = after.counter[i] - before.counter[i];
+    ok = ok && flow.counter[i] == delta.counter[i];
+  }
+
+  // 1 + 1 + 3 + 2 + 2 blocks, 48 + 32 + 20 CBC bytes
+  ok = ok && delta.counter[AES128_STAT_ECB_ENCRYPT_BLOCKS] == 1 && delta.counter[AES128_STAT_ECB_ENCRYPT_BYTES] == 16
+    && delta.counter[AES128_STAT_ECB_DECRYPT_BLOCKS] == 1 && delta.counter[AES128_STAT_ECB_DECRYPT_BYTES] == 16
+    && delta.counter[AES128_STAT_CBC_ENCRYPT_BLOCKS] == 7 && delta.counter[AES128_STAT_CBC_ENCRYPT_BYTES] == 100
+    && delta.counter[AES128_STAT_CBC_DECRYPT_BLOCKS] == 0 && delta.counter[AES128_STAT_KEY_REUSES] == 2
+    && delta.counter[AES128_STAT_STORED_SCHEDULE] + delta.counter[AES128_STAT_ON_THE_FLY] == 9;
+
+  AES128_stats_snapshot(&after);
+  ok = ok && flow.counter[AES128_STAT_ECB_ENCRYPT_BLOCKS] == 1
+    && after.counter[AES128_STAT_ECB_ENCRYPT_BLOCKS] - before.counter[AES128_STAT_ECB_ENCRYPT_BLOCKS] == 2;
+
+  printf("Stats: ");
+
+  if(ok)
+  {
+    printf("SUCCESS!\n");
+  }
+  else
+  {
+    printf("FAILURE!\n");
+  }
+}
+
+static void test_stats_prometheus(void)
+{
+  // The full text, and a truncated copy that is a terminated prefix of it with the full length returned
+
+  const char* line = "aes128_blocks_total{mode=\"cbc\",op=\"encrypt\"} 7\n";
+  char full[4096];
+  char part[32];
+  AES128_stats_t stats;
+  int n;
+  int ok;
+
+  memset(&stats, 0, sizeof(stats));
+  stats.counter[AES128_STAT_CBC_ENCRYPT_BLOCKS] = 7;
+  stats.counter[AES128_STAT_KEY_REUSES] = 12345678901ull;
+
+  n = AES128_stats_prometheus(&stats, full, sizeof(full));
+  ok = n > 0 && (size_t)n == strlen(full) && strstr(full, line) != 0
+    && strstr(full, "# TYPE aes128_blocks_total counter\n") != 0
+    && strstr(full, "\naes128_key_reuses_total 12345678901\n") != 0;
+
+  memset(part, 'x', sizeof(part));
+  ok = ok && AES128_stats_prometheus(&stats, part, sizeof(part)) == n;
+  ok = ok && part[sizeof(part) - 1] == '\0' && 0 == strncmp(part, full, sizeof(part) - 1);
+
+  printf("Stats Prometheus: ");
+
+  if(ok)
+  {
+    printf("SUCCESS!\n");
+  }
+  else
+  {
+    printf("FAILURE!\n");
+  }
+}
+
+#endif // #if AES128_STATS
@@ -0,0 +1,175 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "aes.h"
+#include "afalg.h"
+
+// Checks the kernel's CTR mode through afalg.c against "openssl enc -aes-128-ctr". The
+// message spans several AFALG_CHUNKs and the counter carries across five bytes on the way,
+// so both the chunking and the counter update between calls are covered. A CTR built from
+// AES128_ECB_encrypt_keyed() is checked against openssl as well, which also runs where the
+// kernel has no AF_ALG. Either part is skipped, not failed, when openssl or AF_ALG is missing.
+
+#define MSG_LEN (3 * 64 * 1024 + 4096 + 48)
+
+static int openssl_ctr(void);
+static void test_ctr_reference(void);
+static void test_afalg_ctr(void);
+
+static const uint8_t key[16] = { 0x2b, 0x7e, 0x15, 0x16, 0x28, 0xae, 0xd2, 0xa6, 0xab, 0xf7, 0x15, 0x88, 0x09, 0xcf, 0x4f, 0x3c };
+static const uint8_t iv[16]  = { 0xf0, 0xf1, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8, 0xf9, 0xff, 0xff, 0xff, 0xff, 0xf0, 0x00 };
+static uint8_t plain[MSG_LEN];
+static uint8_t expected[MSG_LEN];
+static int have_expected;
+
+
+
+int main(void)
+{
+    uint32_t i;
+
+    for(i = 0; i < MSG_LEN; ++i)
+    {
+        plain[i] = (uint8_t)(i * 131 + (i >> 8));
+    }
+    have_expected = openssl_ctr() == 0;
+
+    test_ctr_reference();
+    test_afalg_ctr();
+
+    return 0;
+}
+
+
+
+static void result(const char* test, int ok)
+{
+  printf("%s: ", test);
+
+  if(ok)
+  {
+    printf("SUCCESS!\n");
+  }
+  else
+  {
+    printf("FAILURE!\n");
+  }
+}
+
+static void hex(char* str, const uint8_t* bytes)
+{
+  uint8_t i;
+  for(i = 0; i < 16; ++i)
+  {
+    sprintf(str + 2 * i, "%02x", bytes[i]);
+  }
+}
+
+// Fills expected with openssl's encryption of plain. Returns 0, or -1 if openssl did not run.
+static int openssl_ctr(void)
+{
+  char path[] = "/tmp/aes-test-afalg-XXXXXX";
+  char cmd[256], key_hex[33], iv_hex[33];
+  FILE* f;
+  size_t n = 0;
+  int fd, rc;
+
+  fd = mkstemp(path);
+  if(fd < 0)
+  {
+    return -1;
+  }
+  rc = (write(fd, plain, MSG_LEN) == MSG_LEN) ? 0 : -1;
+  close(fd);
+
+  hex(key_hex, key);
+  hex(iv_hex, iv);
+  snprintf(cmd, sizeof(cmd), "openssl enc -aes-128-ctr -K %s -iv %s -nopad -in %s 2>/dev/null", key_hex, iv_hex, path);
+  f = (rc == 0) ? popen(cmd, "r") : NULL;
+  if(f != NULL)
+  {
+    n = fread(expected, 1, MSG_LEN, f);
+    rc = (pclose(f) == 0 && n == MSG_LEN) ? 0 : -1;
+  }
+  else
+  {
+    rc = -1;
+  }
+  unlink(path);
+  return rc;
+}
+
+static void test_ctr_reference(void)
+{
+  // CTR from the library's keyed ECB: the counter is the IV as a big-endian 128 bit number
+
+  AES128_key_t ctx;
+  uint8_t counter[16], stream[16];
+  static uint8_t out[MSG_LEN];
+  uint32_t i;
+  int j;
+
+  if(!have_expected)
+  {
+    printf("CTR reference: skipped, openssl enc did not run\n");
+    return;
+  }
+
+  AES128_expand_key(&ctx, key);
+  memcpy(counter, iv, sizeof(counter));
+  for(i = 0; i < MSG_LEN; i += 16)
+  {
+    AES128_ECB_encrypt_keyed(counter, &ctx, stream);
+    for(j = 0; j < 16; ++j)
+    {
+      out[i + j] = plain[i + j] ^ stream[j];
+    }
+    for(j = 15; j >= 0 && ++counter[j] == 0; --j)
+    {
+    }
+  }
+
+  result("CTR reference", 0 == memcmp(out, expected, MSG_LEN));
+}
+
+static void test_afalg_ctr(void)
+{
+  // Out of place (spliced) in uneven calls, then in place (copied) in one call, then back
+
+  static uint8_t out[MSG_LEN];
+  uint8_t counter[16];
+  afalg_t k;
+  size_t first = 1000 * 16;
+  int ok;
+
+  if(!have_expected)
+  {
+    printf("AF_ALG CTR: skipped, openssl enc did not run\n");
+    return;
+  }
+  if(afalg_open(&k, AFALG_CTR, key) != 0)
+  {
+    printf("AF_ALG CTR: skipped, %s\n", strerror(errno));
+    return;
+  }
+
+  memcpy(counter, iv, sizeof(counter));
+  ok = afalg_crypt(&k, 0, out, plain, first, counter) == 0
+    && afalg_crypt(&k, 0, out + first, plain + first, MSG_LEN - first, counter) == 0
+    && 0 == memcmp(out, expected, MSG_LEN);
+
+  memcpy(out, plain, MSG_LEN);
+  memcpy(counter, iv, sizeof(counter));
+  ok = ok && afalg_crypt(&k, 0, out, out, MSG_LEN, counter) == 0 && 0 == memcmp(out, expected, MSG_LEN);
+
+  memcpy(counter, iv, sizeof(counter));
+  ok = ok && afalg_crypt(&k, 1, out, out, MSG_LEN, counter) == 0 && 0 == memcmp(out, plain, MSG_LEN);
+
+  afalg_close(&k);
+
+  result("AF_ALG CTR", ok);
+}
@@ -0,0 +1,162 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "aes.h"
+#include "keyfile.h"
+
+static void test_keyfile_roundtrip(void);
+static void test_keyfile_checksum(void);
+static void test_keyfile_header(void);
+static void test_keyfile_mode(void);
+
+static char path[64];
+static AES128_key_t keys[4];
+
+
+
+int main(void)
+{
+    uint8_t raw[4 * 16];
+    uint8_t i;
+
+    snprintf(path, sizeof(path), "/tmp/aes-test-keyfile-%ld", (long)getpid());
+    for(i = 0; i < sizeof(raw); ++i)
+    {
+        raw[i] = (uint8_t)(i * 37 + 11);
+    }
+    AES128_expand_keys(keys, raw, 4);
+
+    test_keyfile_roundtrip();
+    test_keyfile_checksum();
+    test_keyfile_header();
+    test_keyfile_mode();
+
+    unlink(path);
+    return 0;
+}
+
+
+
+static void result(const char* test, int ok)
+{
+  printf("%s: ", test);
+
+  if(ok)
+  {
+    printf("SUCCESS!\n");
+  }
+  else
+  {
+    printf("FAILURE!\n");
+  }
+}
+
+// Overwrites one byte of the file at path, returns 0 on success
+static int patch(long offset, uint8_t value)
+{
+  FILE* f = fopen(path, "r+b");
+  int rc;
+
+  if(f == NULL)
+  {
+    return -1;
+  }
+  rc = (fseek(f, offset, SEEK_SET) == 0 && fputc(value, f) != EOF) ? 0 : -1;
+  return (fclose(f) == 0) ? rc : -1;
+}
+
+static int same_keys(const AES128_key_t* a, const AES128_key_t* b, uint32_t count)
+{
+  uint32_t i;
+
+  for(i = 0; i < count; ++i)
+  {
+    if(0 != memcmp(a[i].RoundKey, b[i].RoundKey, sizeof(a[i].RoundKey)))
+    {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+static void test_keyfile_roundtrip(void)
+{
+  // Saved keys come back through the mapping and through keyfile_load(), which stops at max
+
+  AES128_key_t loaded[4];
+  keyfile_t* kf;
+  int ok;
+
+  ok = keyfile_save(path, keys, 4) == 0;
+  kf = ok ? keyfile_open(path) : NULL;
+  ok = ok && (kf != NULL) && keyfile_count(kf) == 4 && same_keys(keyfile_keys(kf), keys, 4);
+  ok = ok && ((uintptr_t)keyfile_keys(kf) % _Alignof(AES128_key_t)) == 0;
+  keyfile_close(kf);
+
+  ok = ok && keyfile_load(path, loaded, 4) == 4 && same_keys(loaded, keys, 4);
+  ok = ok && keyfile_load(path, loaded, 2) == 2;
+
+  result("Key file round trip", ok);
+}
+
+static void test_keyfile_checksum(void)
+{
+  // A flipped bit in a round key of the second record is caught by the checksum
+
+  long header = (AES128_KEY_ALIGN > 64) ? (long)AES128_KEY_ALIGN : 64;
+  AES128_key_t loaded[1];
+  int ok;
+
+  ok = keyfile_save(path, keys, 4) == 0;
+  ok = ok && patch(header + (long)sizeof(AES128_key_t) + 100, keys[1].RoundKey[100] ^ 0x01) == 0;
+  ok = ok && keyfile_open(path) == NULL && keyfile_load(path, loaded, 1) == -1;
+
+  result("Key file checksum", ok);
+}
+
+static void test_keyfile_header(void)
+{
+  // Files of another format version or another record size are refused
+
+  keyfile_t* kf;
+  int ok;
+
+  ok = keyfile_save(path, keys, 4) == 0 && patch(4, KEYFILE_VERSION + 1) == 0;
+  ok = ok && keyfile_open(path) == NULL;
+
+  ok = ok && keyfile_save(path, keys, 4) == 0 && patch(8, (uint8_t)(sizeof(AES128_key_t) + 16)) == 0;
+  ok = ok && keyfile_open(path) == NULL;
+
+  // and the untouched file is still accepted
+  ok = ok && keyfile_save(path, keys, 4) == 0;
+  kf = ok ? keyfile_open(path) : NULL;
+  ok = ok && (kf != NULL);
+  keyfile_close(kf);
+
+  result("Key file header", ok);
+}
+
+static void test_keyfile_mode(void)
+{
+  // The file holds secret schedules: owner-only whatever the umask, also when it replaces a readable file
+
+  struct stat st;
+  mode_t old_mask;
+  FILE* f;
+  int ok;
+
+  unlink(path);
+  f = fopen(path, "w");
+  ok = (f != NULL) && fclose(f) == 0 && chmod(path, 0644) == 0;
+
+  old_mask = umask(0);
+  ok = ok && keyfile_save(path, keys, 4) == 0;
+  umask(old_mask);
+
+  ok = ok && lstat(path, &st) == 0 && S_ISREG(st.st_mode) && (st.st_mode & 07777) == 0600;
+
+  result("Key file mode", ok);
+}
@@ -0,0 +1,176 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#include "aes.h"
+#include "keystore.h"
+
+static void test_keystore_roundtrip(void);
+static void test_keystore_rotation(void);
+static void test_keystore_full(void);
+static void test_keystore_recreate(void);
+
+static char name[64];
+
+
+
+int main(void)
+{
+    snprintf(name, sizeof(name), "/aes-test-keystore-%ld", (long)getpid());
+
+    test_keystore_roundtrip();
+    test_keystore_rotation();
+    test_keystore_full();
+    test_keystore_recreate();
+
+    keystore_unlink(name);
+    return 0;
+}
+
+
+
+static void result(const char* test, int ok)
+{
+  printf("%s: ", test);
+
+  if(ok)
+  {
+    printf("SUCCESS!\n");
+  }
+  else
+  {
+    printf("FAILURE!\n");
+  }
+}
+
+static void test_keystore_roundtrip(void)
+{
+  // Keys put by the creating process come back from a read-only mapping, unknown IDs do not
+
+  uint8_t keys[3 * 16];
+  uint32_t ids[3] = { 7, 1000, 0xffffffffu };
+  AES128_key_t expected, got;
+  keystore_t* writer;
+  keystore_t* reader;
+  uint8_t i;
+  int ok;
+
+  for(i = 0; i < sizeof(keys); ++i)
+  {
+    keys[i] = (uint8_t)(i * 29 + 3);
+  }
+
+  writer = keystore_create(name, 16);
+  ok = (writer != NULL) && keystore_put(writer, ids, keys, 3) == 0;
+  reader = ok ? keystore_open(name) : NULL;
+  ok = ok && (reader != NULL);
+
+  for(i = 0; ok && i < 3; ++i)
+  {
+    AES128_expand_key(&expected, keys + i * 16);
+    ok = keystore_get(reader, ids[i], &got) == 0 && 0 == memcmp(expected.RoundKey, got.RoundKey, sizeof(got.RoundKey));
+  }
+  ok = ok && keystore_get(reader, 8, &got) != 0;
+
+  keystore_close(reader);
+  keystore_close(writer);
+
+  result("Keystore round trip", ok);
+}
+
+static void test_keystore_rotation(void)
+{
+  // Replacing a key bumps the generation, and a reader that mapped the store before sees the new schedule
+
+  uint8_t old_key[16] = { 0x2b, 0x7e, 0x15, 0x16, 0x28, 0xae, 0xd2, 0xa6, 0xab, 0xf7, 0x15, 0x88, 0x09, 0xcf, 0x4f, 0x3c };
+  uint8_t new_key[16] = { 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f };
+  uint32_t id = 42;
+  AES128_key_t expected, got;
+  keystore_t* writer;
+  keystore_t* reader;
+  uint64_t generation = 0;
+  int ok;
+
+  writer = keystore_create(name, 16);
+  ok = (writer != NULL) && keystore_put(writer, &id, old_key, 1) == 0;
+  reader = ok ? keystore_open(name) : NULL;
+  ok = ok && (reader != NULL);
+  if(ok)
+  {
+    generation = keystore_generation(reader);
+    ok = keystore_put(writer, &id, new_key, 1) == 0 && keystore_generation(reader) > generation;
+  }
+
+  AES128_expand_key(&expected, new_key);
+  ok = ok && keystore_get(reader, id, &got) == 0 && 0 == memcmp(expected.RoundKey, got.RoundKey, sizeof(got.RoundKey));
+
+  keystore_close(reader);
+  keystore_close(writer);
+
+  result("Keystore rotation", ok);
+}
+
+static void test_keystore_full(void)
+{
+  // A store for 4 keys has 8 entries: the 9th ID is refused, replacing a stored key still works,
+  // and a capacity whose table would not fit 32 bits is refused
+
+  uint8_t keys[9 * 16];
+  uint32_t ids[9];
+  AES128_key_t expected, got;
+  keystore_t* ks;
+  uint8_t i;
+  int ok;
+
+  for(i = 0; i < sizeof(keys); ++i)
+  {
+    keys[i] = (uint8_t)(i * 13 + 5);
+  }
+  for(i = 0; i < 9; ++i)
+  {
+    ids[i] = 100 + i;
+  }
+
+  ks = keystore_create(name, 4);
+  ok = (ks != NULL) && keystore_put(ks, ids, keys, 8) == 0;
+  ok = ok && keystore_put(ks, &ids[8], keys + 8 * 16, 1) != 0 && keystore_get(ks, ids[8], &got) != 0;
+  ok = ok && keystore_put(ks, &ids[0], keys + 8 * 16, 1) == 0;
+
+  AES128_expand_key(&expected, keys + 8 * 16);
+  ok = ok && keystore_get(ks, ids[0], &got) == 0 && 0 == memcmp(expected.RoundKey, got.RoundKey, sizeof(got.RoundKey));
+  keystore_close(ks);
+
+  ok = ok && keystore_create(name, 0x80000000u) == NULL;
+
+  result("Keystore full table", ok);
+}
+
+static void test_keystore_recreate(void)
+{
+  // Creating the store again must not take the pages away from a process that still maps the old one
+
+  uint8_t key[16] = { 0x2b, 0x7e, 0x15, 0x16, 0x28, 0xae, 0xd2, 0xa6, 0xab, 0xf7, 0x15, 0x88, 0x09, 0xcf, 0x4f, 0x3c };
+  uint32_t id = 1;
+  AES128_key_t expected, got;
+  keystore_t* first;
+  keystore_t* reader;
+  keystore_t* second;
+  int ok;
+
+  first = keystore_create(name, 16);
+  ok = (first != NULL) && keystore_put(first, &id, key, 1) == 0;
+  reader = ok ? keystore_open(name) : NULL;
+  second = keystore_create(name, 16);
+  ok = ok && (reader != NULL) && (second != NULL);
+
+  AES128_expand_key(&expected, key);
+  ok = ok && keystore_get(reader, id, &got) == 0 && 0 == memcmp(expected.RoundKey, got.RoundKey, sizeof(got.RoundKey));
+  ok = ok && keystore_get(second, id, &got) != 0;
+
+  keystore_close(second);
+  keystore_close(reader);
+  keystore_close(first);
+
+  result("Keystore recreate", ok);
+}
@@ -0,0 +1,39 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+
+// Builds aes.c into this file to reach the private tables and ComputeTables(), which
+// COMPUTE_TABLES=1 builds use instead of the constant tables.
+#define AES128_TEST_TABLES
+#include "aes.c"
+
+static void test_compute_tables(void);
+
+
+
+int main(void)
+{
+    test_compute_tables();
+
+    return 0;
+}
+
+
+
+static void test_compute_tables(void)
+{
+  uint8_t s[256], rs[256], rc[11];
+
+  ComputeTables(s, rs, rc);
+
+  printf("Computed tables: ");
+
+  if(0 == memcmp(s, sbox, sizeof(s)) && 0 == memcmp(rs, rsbox, sizeof(rs)) && 0 == memcmp(rc, Rcon, sizeof(rc)))
+  {
+    printf("SUCCESS!\n");
+  }
+  else
+  {
+    printf("FAILURE!\n");
+  }
+}